@@ -125,3 +125,63 @@ struct mcfg {
 	struct mcfg_entry entries[1];
 } __attribute__ ((packed));
 
+/* The ACPI System Resource Affinity Table (SRAT) */
+struct srat {
+	struct acpi_hdr hdr;
+	uint32_t        _0;
+	uint64_t        _1;
+} __attribute__ ((packed));
+
+struct srat_lapic {
+	uint8_t  domain_lo;
+	uint8_t  apic_id;
+	uint32_t flags;
+	uint8_t  sapic_eid;
+	uint8_t  domain_hi[3];
+	uint32_t clock_domain;
+} __attribute__ ((packed));
+
+struct srat_mem {
+	uint32_t domain;
+	uint16_t _0;
+	uint64_t base;
+	uint64_t len;
+	uint32_t _1;
+	uint32_t flags;
+	uint64_t _2;
+} __attribute__ ((packed));
+
+struct srat_x2apic {
+	uint16_t _0;
+	uint32_t domain;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t clock_domain;
+	uint32_t _1;
+} __attribute__ ((packed));
+
+struct srat_entry {
+	uint8_t type;
+	uint8_t len;
+	union {
+		struct srat_lapic  lapic;
+		struct srat_mem    mem;
+		struct srat_x2apic x2apic;
+	};
+} __attribute__ ((packed));
+
+enum {
+	SRAT_LAPIC = 0,
+	SRAT_MEM,
+	SRAT_X2APIC,
+};
+
+/* The flags of the SRAT entries. */
+#define SRAT_ENABLED (1 << 0)
+
+/* The ACPI System Locality Information Table (SLIT) */
+struct slit {
+	struct acpi_hdr hdr;
+	uint64_t        nlocalities;
+	uint8_t         entries[1];
+} __attribute__ ((packed));
@@ -16,6 +16,7 @@
 #include <x86-64/memory.h>
 
 #include <kernel/mem/slab.h>
+#include <kernel/mem/tlb.h>
 #include <kernel/acpi.h>
 
 /* Values of status in struct cpuinfo */
@@ -25,9 +26,26 @@ enum {
 	CPU_HALTED,
 };
 
+/* Per-CPU magazines of free objects in front of the shared slab allocators,
+ * and the counters of this CPU, both indexed by the id of the slab allocator.
+ */
 struct kmem_cache {
-	struct slab _slabs[32];
-	size_t _nslabs;
+	struct kmem_magazine mags[KMEM_MAX_CACHES];
+	struct kmem_stats stats[KMEM_MAX_CACHES];
+};
+
+/* Per-CPU cache of free order-0 pages in front of the buddy allocator, with
+ * separate lists for each mobility type.
+ */
+struct page_cache {
+	struct list pages[NR_MIGRATE_TYPES];
+	size_t count[NR_MIGRATE_TYPES];
+
+	/* Pages that have been zeroed while the CPU was idle. */
+	struct list zeroed[NR_MIGRATE_TYPES];
+	size_t nzeroed[NR_MIGRATE_TYPES];
+
+	int enabled;
 };
 
 /* Per-CPU state */
@@ -35,6 +53,9 @@ struct cpuinfo {
 	/* The local APIC ID. */
 	uint8_t cpu_id;
 
+	/* The NUMA node of the CPU. */
+	uint8_t cpu_nid;
+
 	/* The status of the CPU. */
 	volatile unsigned cpu_status;
 
@@ -47,6 +68,12 @@ struct cpuinfo {
 	/* Per-CPU slab allocator */
 	struct kmem_cache kmem;
 
+	/* Per-CPU page cache */
+	struct page_cache page_cache;
+
+	/* The address spaces that have TLB entries tagged on this CPU */
+	struct tlb_state tlb;
+
 	/* Per-CPU run queue */
 	struct list runq, nextq;
 	size_t runq_len;
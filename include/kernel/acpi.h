@@ -5,5 +5,7 @@
 #include <kernel/acpi/lapic.h>
 #include <kernel/acpi/madt.h>
 #include <kernel/acpi/mcfg.h>
+#include <kernel/acpi/slit.h>
+#include <kernel/acpi/srat.h>
 
 
@@ -0,0 +1,5 @@
+#pragma once
+
+#include <acpi.h>
+
+int slit_init(struct rsdp *rsdp);
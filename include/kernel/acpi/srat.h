@@ -0,0 +1,5 @@
+#pragma once
+
+#include <acpi.h>
+
+int srat_init(struct rsdp *rsdp);
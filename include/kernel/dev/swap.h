@@ -15,6 +15,9 @@ struct rmap_info {
     struct page_info *page;
 	physaddr_t disk_addr;
 	physaddr_t pa;
+
+	/* The address at which the page is mapped. */
+	uintptr_t va;
 };
 
 void mru_swap_page(struct page_info *page);
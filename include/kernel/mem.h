@@ -2,6 +2,8 @@
 
 #include <kernel/mem/boot.h>
 #include <kernel/mem/buddy.h>
+#include <kernel/mem/color.h>
+#include <kernel/mem/compact.h>
 #include <kernel/mem/dump.h>
 #include <kernel/mem/init.h>
 #include <kernel/mem/insert.h>
@@ -13,6 +15,7 @@
 #include <kernel/mem/ptlb.h>
 #include <kernel/mem/remove.h>
 #include <kernel/mem/slab.h>
+#include <kernel/mem/thp.h>
 #include <kernel/mem/tlb.h>
 #include <kernel/mem/user.h>
 #include <kernel/mem/walk.h>
@@ -4,6 +4,7 @@
 #include <assert.h>
 #include <paging.h>
 #include <kernel/monitor.h>
+#include <kernel/mem/numa.h>
 
 #include <x86-64/memory.h>
 
@@ -44,6 +45,8 @@ enum {
 	ALLOC_ZERO = 1 << 0,
 	ALLOC_HUGE = 1 << 1,
 	ALLOC_PREMAPPED = 1 << 2,
+	/* For page_alloc, the page can be migrated (i.e. user pages). */
+	ALLOC_MOVABLE = 1 << 3,
 };
 
 /* The buddy allocator order for known page sizes. */
@@ -53,6 +56,42 @@ enum {
 	BUDDY_1G_PAGE = 18,
 };
 
+/* The free lists of the buddy allocator for a single NUMA node. */
+struct buddy_zone {
+	/*
+	 * List of free buddy chunks (often also referred to as buddy pages or
+	 * simply pages). Each order has a list containing all free buddy chunks
+	 * of the specific buddy order for every mobility type. Buddy orders go
+	 * from 0 to BUDDY_MAX_ORDER - 1
+	 */
+	struct list free_list[NR_MIGRATE_TYPES][BUDDY_MAX_ORDER];
+
+	/*
+	 * Number of free chunks of each order across the mobility types and the
+	 * total number of free pages on the free lists.
+	 */
+	size_t nfree[BUDDY_MAX_ORDER];
+	size_t nfree_pages;
+};
+
+extern struct buddy_zone buddy_zones[MAX_NUMNODES];
+
+/* Free memory statistics of the buddy allocator. */
+struct buddy_stats {
+	/* Number of free chunks on the free list of each order. */
+	size_t nfree[BUDDY_MAX_ORDER];
+
+	/* Total number of free pages on the free lists. */
+	size_t nfree_pages;
+
+	/* Number of free pages on the free lists of each NUMA node. */
+	size_t nnodes;
+	size_t node_nfree_pages[MAX_NUMNODES];
+
+	/* Number of free pages held by the per-CPU page caches. */
+	size_t ncached_pages;
+};
+
 void lock_buddy();
 void unlock_buddy();
 void debug_buddy_free_list();
@@ -61,11 +100,26 @@ void debug_show_buddy_info(void);
 size_t count_free_pages(size_t order);
 void show_buddy_info(void);
 size_t count_total_free_pages(void);
+void buddy_get_stats(struct buddy_stats *stats);
+struct page_info *page_alloc_order(size_t order, int alloc_flags);
 struct page_info *page_alloc(int alloc_flags);
-struct page_info *buddy_find(size_t req_order);
+struct page_info *buddy_find(size_t req_order, int migratetype);
+void buddy_free_page(struct page_info *pp);
+void buddy_isolate(struct page_info *page);
 void page_free(struct page_info *pp);
+void page_free_order(struct page_info *pp, size_t order);
+size_t page_alloc_bulk(size_t n, int alloc_flags, struct list *list);
+void page_free_list(struct list *list);
+void page_cache_init(void);
+void page_cache_drain(void);
+void page_zero_idle(void);
+size_t count_cached_pages(void);
 void page_decref(struct page_info *pp);
 void buddy_migrate(void);
+void buddy_init(void);
+void buddy_init_zones(void);
+void buddy_prepare_range(struct page_info *base, size_t n, struct list *chunks);
+void buddy_free_chunks(struct list *chunks);
 int buddy_map_chunk(struct page_table *pml4, size_t index);
 
 static inline physaddr_t page2pa(struct page_info *pp)
@@ -88,3 +142,22 @@ static inline void *page2kva(struct page_info *pp)
 	return KADDR(page2pa(pp));
 }
 
+/* Gets the first page of the 2M page block that the page is in. */
+static inline struct page_info *page_block(struct page_info *pp)
+{
+	return pages + ROUNDDOWN((size_t)(pp - pages), 1 << BUDDY_2M_PAGE);
+}
+
+/* Gets the mobility type of the 2M page block that the page is in. */
+static inline int page_blocktype(struct page_info *pp)
+{
+	return page_block(pp)->pp_blocktype;
+}
+
+/* Gets the mobility type to allocate from for the given allocation flags. */
+static inline int alloc_migratetype(int alloc_flags)
+{
+	return (alloc_flags & ALLOC_MOVABLE) ? MIGRATE_MOVABLE :
+		MIGRATE_UNMOVABLE;
+}
+
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <types.h>
+#include <paging.h>
+
+/* The maximum number of page colors to distinguish. */
+#define PAGE_COLORS_MAX  64
+
+/* The number of free pages to keep around per color. Any pages beyond that
+ * are returned to the buddy allocator.
+ */
+#define PAGE_COLOR_HIGH  32
+
+extern size_t page_colors;
+
+void page_color_init(void);
+size_t page_color(struct page_info *page);
+struct page_info *page_alloc_color(size_t color, int alloc_flags);
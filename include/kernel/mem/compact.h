@@ -0,0 +1,21 @@
+#pragma once
+
+#include <types.h>
+
+/* The compaction thread tries to keep at least COMPACT_HUGE_LOW free 2M
+ * blocks around, as long as there are more than COMPACT_MIN_FREE free pages.
+ */
+#define COMPACT_HUGE_LOW 8
+#define COMPACT_MIN_FREE 4096
+
+/* The number of 2M blocks the compaction thread looks at per run. */
+#define COMPACT_BATCH    16
+
+/* The number of 2M blocks a failed huge page allocation compacts directly,
+ * before leaving the rest to the compaction thread.
+ */
+#define COMPACT_DIRECT   4
+
+int compact_block(size_t index);
+int compact_memory(size_t nblocks);
+void compact_thread(void);
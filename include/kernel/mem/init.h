@@ -12,4 +12,5 @@ void mem_init_mp(void);
 void mem_init(struct boot_info *boot_info);
 void page_init(struct boot_info *boot_info);
 void page_init_ext(struct boot_info *boot_info);
+void page_init_deferred(void);
 
@@ -4,15 +4,24 @@
 
 #include <kernel/mem/slab.h>
 
-#define slabs (this_cpu->kmem._slabs)
-#define nslabs (this_cpu->kmem._nslabs)
+struct slabinfo;
+
+extern struct slab slabs[KMEM_MAX_CACHES];
+extern size_t nslabs;
 
 
 
 int kmem_init(void);
 int kmem_init_mp(void);
 void *kmalloc(size_t size);
+void *kzalloc(size_t size);
 void kfree(void *p);
+struct slab *kmem_cache_create(const char *name, size_t size, size_t align,
+	void (*ctor)(void *));
+void *kmem_cache_alloc(struct slab *cache);
+void kmem_cache_free(struct slab *cache, void *p);
+size_t kmem_shrink(void);
+int kmem_get_info(size_t id, struct slabinfo *info);
 
 
 void debug_print_slab();
\ No newline at end of file
@@ -5,4 +5,4 @@
 
 struct page_info *page_lookup(struct page_table *pml4, void *va,
 	physaddr_t **entry_store);
-
+physaddr_t *pde_lookup(struct page_table *pml4, void *va);
@@ -6,6 +6,8 @@
 
 void boot_map_region(struct page_table *pml4, void *va, size_t size,
     physaddr_t pa, uint64_t flags);
+void boot_map_huge_region(struct page_table *pml4, void *va, size_t size,
+    physaddr_t pa, uint64_t flags);
 void *mmio_map_region(physaddr_t pa, size_t size);
 void boot_map_kernel(struct page_table *pml4, struct elf *elf_hdr);
 uint64_t convert_flags_from_elf_to_pages(struct elf_proghdr *hdr);
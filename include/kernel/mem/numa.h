@@ -0,0 +1,24 @@
+#pragma once
+
+#include <types.h>
+#include <acpi.h>
+
+/* The maximum number of NUMA nodes and SRAT memory ranges we keep track of.
+ * The node of a page is stored in three bits of struct page_info.
+ */
+#define MAX_NUMNODES    8
+#define MAX_NUMA_RANGES 32
+
+/* The SLIT distances of a node to itself and to other nodes by default. */
+#define NUMA_LOCAL_DISTANCE  10
+#define NUMA_REMOTE_DISTANCE 20
+
+extern size_t nnodes;
+extern uint8_t node_distance[MAX_NUMNODES][MAX_NUMNODES];
+extern uint8_t node_fallback[MAX_NUMNODES][MAX_NUMNODES];
+
+int numa_add_memory(uint32_t domain, physaddr_t base, size_t len);
+int numa_add_cpu(uint32_t domain, uint32_t apic_id);
+void numa_set_distance(uint32_t from, uint32_t to, uint8_t distance);
+int pa2nid(physaddr_t pa);
+void numa_init(struct rsdp *rsdp);
@@ -5,3 +5,4 @@
 
 void populate_region(struct page_table *pml4, void *va, size_t size,
 	uint64_t flags);
+int populate_huge(struct page_table *pml4, void *va, uint64_t flags);
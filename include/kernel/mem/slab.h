@@ -2,30 +2,110 @@
 
 #include <types.h>
 #include <list.h>
+#include <spinlock.h>
 
 #define SLAB_ALIGN 32
 
+/* The alignment to use for objects that should not share cache lines. */
+#define CACHE_LINE_SIZE 64
+
+/* The number of free objects each CPU keeps around per slab allocator, and
+ * the number of objects to move between a magazine and the slabs at once.
+ */
+#define KMEM_MAG_SIZE  16
+#define KMEM_MAG_BATCH (KMEM_MAG_SIZE / 2)
+
+/* The largest order of the number of pages per slab. */
+#define SLAB_MAX_ORDER 3
+
+/* The number of slabs without any allocated objects that each slab allocator
+ * keeps around, rather than returning them to the buddy allocator right away.
+ */
+#define SLAB_EMPTY_MAX 2
+
+/* The maximum number of slab allocators with a magazine on every CPU: the
+ * size classes of kmalloc() and the caches from kmem_cache_create().
+ */
+#define KMEM_MAX_CACHES 40
+
 struct slab {
 	struct list partial, full;
 	uintptr_t info_off;
 	size_t obj_size;
 	size_t count;
+
+	/* Every slab consists of 2^order pages. */
+	size_t order;
+
+	/* The slabs of which all objects are free, up to SLAB_EMPTY_MAX. */
+	struct list empty;
+	size_t nempty;
+
+	/* The offset of the pointer to the next free object within each free
+	 * object. This lies past the end of the object for caches with a
+	 * constructor, such that free objects stay constructed.
+	 */
+	size_t free_off;
+
+	/* The name of the cache, if any. */
+	const char *name;
+
+	/* Called once for every object when a new slab is allocated. Objects
+	 * must be freed in their constructed state.
+	 */
+	void (*ctor)(void *obj);
+
+	/* The index of the magazines for this slab allocator in the per-CPU
+	 * struct kmem_cache.
+	 */
+	size_t id;
+
+	/* Protects the lists of partial and full slabs, as objects may be
+	 * freed by any CPU.
+	 */
+	struct spinlock lock;
+};
+
+/* A per-CPU stack of free objects of a single slab allocator. */
+struct kmem_magazine {
+	void *objs[KMEM_MAG_SIZE];
+	size_t count;
+};
+
+/* Per-CPU counters of a single slab allocator. */
+struct kmem_stats {
+	size_t nallocs, nfrees;
+
+	/* The number of times the magazine has been refilled from or flushed
+	 * to the slabs.
+	 */
+	size_t nrefills, nflushes;
+
+	/* The number of objects freed on this CPU that belong to a slab that
+	 * was last allocated from by another CPU.
+	 */
+	size_t nremote_frees;
 };
 
 struct slab_info {
 	struct slab *slab;
 	struct list node;
-	struct list free_list;
-	size_t free_count;
-};
 
-struct slab_obj {
-	struct list node;
-	struct slab_info *info;
+	/* The CPU that last allocated an object from this slab. */
+	int cpu;
+
+	/* The first free object, every free object points to the next. */
+	void *free_list;
+	size_t free_count;
 };
 
 int slab_alloc_chunk(struct slab *slab);
 void slab_free_chunk(struct slab *slab, struct slab_info *info);
-void slab_setup(struct slab *slab, size_t obj_size);
+void slab_setup(struct slab *slab, size_t obj_size, size_t align);
 void *slab_alloc(struct slab *slab);
 void slab_free(void *p);
+struct slab_info *slab_get_info(void *p);
+void *slab_next_free(struct slab *slab, void *obj);
+void *slab_cache_alloc(struct slab *slab);
+void slab_cache_free(void *p);
+size_t slab_shrink(struct slab *slab);
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <types.h>
+#include <paging.h>
+
+struct task;
+struct vma;
+
+struct page_info *thp_alloc(int alloc_flags);
+int thp_vma_allowed(struct vma *vma);
+int thp_fault(struct task *task, struct vma *vma, void *va);
+void split_huge_pages(struct page_table *pml4, void *va, size_t size);
+void thp_split_tasks(void);
+void thp_thread(void);
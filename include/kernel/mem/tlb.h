@@ -3,5 +3,75 @@
 #include <types.h>
 #include <paging.h>
 
+/* The default number of pages up to which a range is flushed one page at a
+ * time, rather than flushing the entire TLB. Can be tuned at run time through
+ * tlb_flush_max_pages.
+ */
+#define TLB_FLUSH_MAX_PAGES 32
+
+/* The number of address spaces per CPU of which the TLB entries are kept
+ * across context switches, each tagged with its own PCID.
+ */
+#define TLB_NR_PCIDS 8
+
+/* An address space that recently ran on a CPU. The PCID that tags its TLB
+ * entries is the index of the slot plus one.
+ */
+struct tlb_pcid {
+	/* The physical address of the PML4, or zero if the slot is unused. */
+	physaddr_t pml4;
+
+	/* The value of the clock when the address space was last loaded. */
+	uint64_t last_used;
+
+	/* Set if the page tables changed since the TLB entries were tagged, such
+	 * that they have to be flushed upon the next load.
+	 */
+	volatile uint32_t stale;
+};
+
+struct tlb_state {
+	/* The physical address of the PML4 that is loaded on this CPU. Other
+	 * CPUs send a shootdown IPI to this CPU if they change it.
+	 */
+	volatile physaddr_t pml4;
+
+	struct tlb_pcid pcids[TLB_NR_PCIDS];
+	uint64_t clock;
+
+	/* The number of single pages and full flushes, and the number of
+	 * shootdowns sent to other CPUs.
+	 */
+	uint64_t nflush_pages;
+	uint64_t nflush_full;
+	uint64_t nshootdowns;
+};
+
+/* Collects the range of pages of which the mappings changed while updating
+ * the page tables of an address space, such that the TLB entries can be
+ * flushed on every CPU in one go. Pages and page tables that are no longer
+ * mapped must not be freed until the range has been flushed.
+ */
+struct tlb_gather {
+	struct page_table *pml4;
+	uintptr_t start, end;
+};
+
+extern int pcid_enabled;
+extern size_t tlb_flush_max_pages;
+
+void tlb_init(void);
+void tlb_init_mp(void);
+void tlb_load_pml4(struct page_table *pml4);
 void tlb_invalidate(struct page_table *pml4, void *va);
+void tlb_flush_range(struct page_table *pml4, uintptr_t start, uintptr_t end);
+void tlb_flush(struct page_table *pml4);
+void tlb_flush_user(void);
+void tlb_flush_all(void);
+
+void tlb_gather_init(struct tlb_gather *tlb, struct page_table *pml4);
+void tlb_gather_add(struct tlb_gather *tlb, uintptr_t start, uintptr_t end);
+void tlb_gather_flush(struct tlb_gather *tlb);
 
+void tlb_shootdown_handler(void);
+void tlb_shootdown_poll(void);
@@ -13,8 +13,20 @@ struct page_walker {
 	map_pte_t pte_unmap, pde_unmap, pdpte_unmap, pml4e_unmap;
 	int (* pt_hole_callback)(uintptr_t, uintptr_t, struct page_walker *);
 	void *udata;
+
+	/* The PML4 that is being walked, set by the walk functions. */
+	struct page_table *pml4;
 };
 
+/* Returns whether the range [base, end] passed to a PDE callback spans the
+ * entire 2M area of the PDE. The end of the range may stop short of the last
+ * byte, so only the last page is checked.
+ */
+static inline int hpage_covered(uintptr_t base, uintptr_t end)
+{
+	return hpage_aligned(base) && end >= base + HPAGE_SIZE - PAGE_SIZE;
+}
+
 int walk_page_range(struct page_table *pml4, void *base, void *end,
 	struct page_walker *walker);
 int walk_all_pages(struct page_table *pml4, struct page_walker *walker);
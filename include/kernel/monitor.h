@@ -18,7 +18,10 @@ int mon_help(int argc, char **argv, struct int_frame *frame);
 int mon_kerninfo(int argc, char **argv, struct int_frame *frame);
 int mon_backtrace(int argc, char **argv, struct int_frame *frame);
 int mon_buddyinfo(int argc, char **argv, struct int_frame *frame);
+int mon_meminfo(int argc, char **argv, struct int_frame *frame);
 int mon_pageinfo(int argc, char **argv, struct int_frame *frame);
 int mon_ptdump(int argc, char **argv, struct int_frame *frame);
 int mon_vmainfo(int argc, char **argv, struct int_frame *frame);
+int mon_slabinfo(int argc, char **argv, struct int_frame *frame);
+int mon_tlbinfo(int argc, char **argv, struct int_frame *frame);
 
@@ -6,6 +6,4 @@
 // Use kernel stack in unused memory region
 #define KERNEL_STACK_TOP 0xffffff9000000000
 
-void zero_page(struct page_info *page);
-void zero_all_pages(void);
 void create_kernel_thread(uint64_t func_ptr);
\ No newline at end of file
@@ -12,6 +12,7 @@ struct task *pid2task(pid_t pid, int check_perm);
 void task_init(void);
 struct task *task_alloc(pid_t ppid);
 void task_create(uint8_t *binary, enum task_type type);
+void task_cache_free(struct task *task);
 void task_free(struct task *task);
 void task_destroy(struct task *task);
 void task_pop_frame(struct int_frame *frame);
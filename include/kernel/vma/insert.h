@@ -3,6 +3,12 @@
 #include <task.h>
 #include <vma.h>
 
+#include <kernel/mem/slab.h>
+
+extern struct slab *vma_cache;
+extern struct slab *rmap_cache;
+
+void vma_init(void);
 int insert_vma(struct task *task, struct vma *vma);
 struct vma *add_executable_vma(struct task *task, char *name, void *addr,
 	size_t size, int flags, void *src, size_t len);
@@ -44,6 +44,15 @@ struct vma_info {
 	int vm_prot, vm_type, vm_mapped;
 };
 
+/* The statistics of a slab allocator, as returned by slabinfo(). */
+struct slabinfo {
+	char name[32];
+	size_t obj_size, objs_per_slab, pages_per_slab;
+	size_t active_objs, total_objs;
+	size_t nslabs, npartial, nfull, nempty;
+	size_t nallocs, nfrees, nrefills, nflushes, nremote_frees;
+};
+
 #define USED(x) (void)(x)
 
 /* main user program */
@@ -71,6 +80,7 @@ void *mmap(void *addr, size_t len, int prot, int flags, int fd,
 void munmap(void *addr, size_t len);
 int mprotect(void *addr, size_t len, int prot);
 int madvise(void *addr, size_t len, int advise);
+int slabinfo(struct slabinfo *info, size_t id);
 
 /* File open modes */
 #define O_RDONLY    0x0000      /* open for reading only */
@@ -92,6 +102,7 @@ int madvise(void *addr, size_t len, int advise);
 #define MAP_ANONYMOUS (1 << 1)
 #define MAP_POPULATE  (1 << 4)
 #define MAP_FIXED     (1 << 5)
+#define MAP_COLORED   (1 << 6)
 #define MAP_FAILED    (void *)(0xffffffffffffffffull)
 
 #define MADV_WILLNEED 1
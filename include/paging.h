@@ -5,6 +5,20 @@
 #include <x86-64/paging.h>
 
 #ifndef __ASSEMBLER__
+/*
+ * The mobility of allocations. The buddy allocator groups free pages by the
+ * mobility of the 2M page block they are in, such that unmovable kernel
+ * allocations do not end up scattered across blocks that could otherwise be
+ * compacted into huge pages.
+ */
+enum {
+	MIGRATE_UNMOVABLE = 0,
+	MIGRATE_MOVABLE,
+	NR_MIGRATE_TYPES,
+};
+
+struct slab_info;
+
 /*
  * Page descriptor structures, mapped at USER_PAGES.
  * Read/write to the kernel, read-only to user programs.
@@ -17,29 +31,54 @@
  * FIXME: where?
  */
 struct page_info {
-	/* Next page on the free list. */
-	struct list pp_node;
+	union {
+		/* Next page on the free list, in the page cache or on any other
+		 * list of pages that are not in use by a user mapping.
+		 */
+		struct list pp_node;
+
+		/* Node on the page replacement list, only for user pages that
+		 * are in use.
+		 */
+		struct list swap_node;
+
+		/* The slab this page belongs to, for pages of the slab
+		 * allocator that are in use.
+		 */
+		struct slab_info *pp_slab;
+	};
 
-	struct list swap_node;
+	/* Pointer to reverse mapping struct */
+	struct rmap *rmap;
 
 	/* pp_ref is the count of pointers (usually in page table entries)
 	 * to this page, for pages allocated using page_alloc.
 	 * Pages allocated at boot time using pmap.c's
 	 * boot_alloc do not have valid reference count fields. */
-	uint16_t pp_ref;
+	uint32_t pp_ref;
 
 	/* The order of the page. */
-	uint8_t pp_order : 7;
+	uint32_t pp_order : 5;
 
 	/* Whether the page is actually free. */
-	uint8_t pp_free : 1;
+	uint32_t pp_free : 1;
 
-	/* Reserved. */
-	struct list pp_zero_node;
-	uint64_t pp_zero;
+	/* Whether the page is in a pool of pre-zeroed pages. */
+	uint32_t pp_zero : 1;
 
-	/* Pointer to reverse mapping struct */
-	struct rmap *rmap;
+	/* The NUMA node the page belongs to. */
+	uint32_t pp_nid : 3;
+
+	/* The mobility of the 2M page block, only valid for the first page of
+	 * the block.
+	 */
+	uint32_t pp_blocktype : 1;
+
+	/* Whether the page is the first page of a large kmalloc() allocation. */
+	uint32_t pp_kmalloc : 1;
 };
+
+/* Keep the page descriptors small, such that two of them fit a cache line. */
+#define PAGE_INFO_SIZE 32
 #endif /* !__ASSEMBLER__ */
 
@@ -8,6 +8,7 @@
 #define VM_WRITE (1 << 1)
 #define VM_EXEC  (1 << 2)
 #define VM_DIRTY (1 << 4)
+#define VM_COLOR (1 << 5)
 
 /* A Virtual Memory Area (VMA) describes a virtual memory area in the virtual
  * address space of a task.
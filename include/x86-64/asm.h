@@ -3,9 +3,11 @@
 #define CR0_PM     (1 << 0)
 #define CR0_PAGING (1 << 31)
 
-#define CR4_PAE  (1 << 5)
-#define CR4_SMEP (1 << 20)
-#define CR4_SMAP (1 << 21)
+#define CR4_PAE   (1 << 5)
+#define CR4_PGE   (1 << 7)
+#define CR4_PCIDE (1 << 17)
+#define CR4_SMEP  (1 << 20)
+#define CR4_SMAP  (1 << 21)
 
 #define FLAGS_CF      (1 << 0)
 #define FLAGS_PF      (1 << 2)
@@ -105,6 +107,24 @@ static inline uint64_t read_rflags(void)
 	return rflags;
 }
 
+/* Disables interrupts on the local CPU and returns the previous RFLAGS, such
+ * that irq_restore() can re-enable them if they were enabled before.
+ */
+static inline uint64_t irq_save(void)
+{
+	uint64_t rflags = read_rflags();
+
+	asm volatile("cli" ::: "memory");
+
+	return rflags;
+}
+
+static inline void irq_restore(uint64_t rflags)
+{
+	if (rflags & FLAGS_IF)
+		asm volatile("sti" ::: "memory");
+}
+
 static inline uintptr_t read_cr2(void)
 {
 	uintptr_t ret;
@@ -270,6 +290,19 @@ static inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval)
 	return ret;
 }
 
+/* Invalidates the TLB entries selected by the type for the given PCID and
+ * address.
+ */
+static inline void invpcid(unsigned long type, uint64_t pcid, void *addr)
+{
+	struct {
+		uint64_t pcid;
+		uint64_t addr;
+	} desc = { pcid, (uint64_t)addr };
+
+	asm volatile("invpcid %0, %1" :: "m" (desc), "r" (type) : "memory");
+}
+
 static inline void cpuid(unsigned long fn, uint32_t *eaxp, uint32_t *ebxp,
 	uint32_t *ecxp, uint32_t *edxp)
 {
@@ -292,5 +325,27 @@ static inline void cpuid(unsigned long fn, uint32_t *eaxp, uint32_t *ebxp,
 		*edxp = edx;
 }
 
+static inline void cpuid_count(unsigned long fn, unsigned long idx,
+	uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
+{
+	uint32_t eax, ebx, ecx, edx;
+
+	asm volatile("cpuid" :
+		"=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) :
+		"a" (fn), "c" (idx));
+
+	if (eaxp)
+		*eaxp = eax;
+
+	if (ebxp)
+		*ebxp = ebx;
+
+	if (ecxp)
+		*ecxp = ecx;
+
+	if (edxp)
+		*edxp = edx;
+}
+
 #endif /* !defined(__ASSEMBLER__) */
 
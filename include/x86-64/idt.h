@@ -54,6 +54,9 @@
 #define IRQ_IDE            46
 #define IRQ_ERROR          51
 
+/* Inter-processor interrupts. */
+#define IRQ_TLB            52
+
 /* Software interrupt. */
 #define INT_SYSCALL        128
 
@@ -121,6 +121,17 @@ void lapic_ipi(int vector)
 		;
 }
 
+/* Sends an IPI to the CPU core with the given APIC ID. */
+void lapic_ipi_cpu(uint8_t apic_id, int vector)
+{
+	lapic_write(LAPIC_ICR_HI, apic_id << 24);
+	lapic_write(LAPIC_ICR_LO, LAPIC_FIXED | vector);
+
+	/* Wait for the delivery. */
+	while (lapic_read(LAPIC_ICR_LO) & LAPIC_DELIVERY)
+		;
+}
+
 /* Starts up the core with APIC ID by writing the physical address to the boot
  * code to the Warm Reset Vector, sending a level-triggered INIT interrupt to
  * reset the CPU core and then two startup IPIs to actually start up the core.
@@ -0,0 +1,40 @@
+#include <stdio.h>
+
+#include <kernel/acpi.h>
+#include <kernel/mem.h>
+
+/* Parses the System Locality Information Table (SLIT), which holds the
+ * relative distance between each pair of proximity domains, where 10 is the
+ * distance of a domain to itself. Only the distances between the first
+ * MAX_NUMNODES proximity domains are used.
+ *
+ * Returns -1 if there is no valid SLIT, 0 otherwise.
+ */
+int slit_init(struct rsdp *rsdp)
+{
+	struct slit *slit;
+	uint64_t i, j, n, len;
+
+	slit = acpi_find_table(rsdp, "SLIT");
+
+	if (!slit || slit->hdr.len < sizeof *slit - sizeof slit->entries) {
+		return -1;
+	}
+
+	n = slit->nlocalities;
+	len = slit->hdr.len - (sizeof *slit - sizeof slit->entries);
+
+	// The matrix of n * n distances must fit in the table
+	if (n > len || n * n > len) {
+		cprintf("SLIT: %u localities do not fit the table\n", n);
+		return -1;
+	}
+
+	for (i = 0; i < MIN(n, MAX_NUMNODES); ++i) {
+		for (j = 0; j < MIN(n, MAX_NUMNODES); ++j) {
+			numa_set_distance(i, j, slit->entries[i * n + j]);
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdio.h>
+
+#include <kernel/acpi.h>
+#include <kernel/mem.h>
+
+static void srat_parse_lapic(struct srat_lapic *lapic)
+{
+	uint32_t domain;
+
+	if (!(lapic->flags & SRAT_ENABLED)) {
+		return;
+	}
+
+	domain = lapic->domain_lo |
+		(uint32_t)lapic->domain_hi[0] << 8 |
+		(uint32_t)lapic->domain_hi[1] << 16 |
+		(uint32_t)lapic->domain_hi[2] << 24;
+
+	numa_add_cpu(domain, lapic->apic_id);
+}
+
+static void srat_parse_mem(struct srat_mem *mem)
+{
+	if (!(mem->flags & SRAT_ENABLED) || !mem->len) {
+		return;
+	}
+
+	numa_add_memory(mem->domain, mem->base, mem->len);
+}
+
+static void srat_parse_x2apic(struct srat_x2apic *x2apic)
+{
+	if (!(x2apic->flags & SRAT_ENABLED)) {
+		return;
+	}
+
+	numa_add_cpu(x2apic->domain, x2apic->x2apic_id);
+}
+
+/* Parses the System Resource Affinity Table (SRAT), which tells us the
+ * proximity domain of each CPU and each range of physical memory.
+ *
+ * Returns -1 if there is no SRAT, 0 otherwise.
+ */
+int srat_init(struct rsdp *rsdp)
+{
+	struct srat *srat;
+	struct srat_entry *entry;
+	size_t i, len;
+	char *p;
+
+	srat = acpi_find_table(rsdp, "SRAT");
+
+	if (!srat) {
+		return -1;
+	}
+
+	len = srat->hdr.len - sizeof *srat;
+	p = (char *)(srat + 1);
+
+	for (i = 0; i < len; i += entry->len, p += entry->len) {
+		entry = (struct srat_entry *)p;
+
+		if (!entry->len) {
+			break;
+		}
+
+		switch (entry->type) {
+		case SRAT_LAPIC:
+			srat_parse_lapic(&entry->lapic);
+			break;
+		case SRAT_MEM:
+			srat_parse_mem(&entry->mem);
+			break;
+		case SRAT_X2APIC:
+			srat_parse_x2apic(&entry->x2apic);
+			break;
+		default:
+			break;
+		}
+	}
+
+	return 0;
+}
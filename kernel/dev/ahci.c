@@ -43,7 +43,15 @@ void port_rebase(volatile struct hba_port *port, int port_no)
 	char *p;
 	size_t i;
 
-	page = page_alloc(ALLOC_HUGE | ALLOC_ZERO);
+	/* The command list, the FIS and the 32 command tables take up 9.25 kiB,
+	 * so allocate an order 2 (16 kiB) block.
+	 */
+	page = page_alloc_order(2, ALLOC_ZERO);
+
+	if (!page) {
+		panic("unable to allocate the AHCI port buffers!");
+	}
+
 	p = page2kva(page);
 
 	port->int_stat = 0;
@@ -458,7 +466,7 @@ void ahci_enum_device(volatile struct hba_mem *abar,
 	}
 
 	/* Try to allocate a new disk. */
-	ahci_disk = kmalloc(sizeof *ahci_disk);
+	ahci_disk = kzalloc(sizeof *ahci_disk);
 
 	if (!ahci_disk) {
 		return;
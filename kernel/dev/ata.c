@@ -270,7 +270,7 @@ void ata_enum_device(struct ata_chan *chan, size_t chan_id, size_t drive)
 		return;
 	}
 
-	ata_disk = kmalloc(sizeof *ata_disk);
+	ata_disk = kzalloc(sizeof *ata_disk);
 
 	if (!ata_disk) {
 		return;
@@ -1,5 +1,6 @@
 #include <kernel/mem/walk.h>
 #include <kernel/mem/buddy.h>
+#include <kernel/mem/kmem.h>
 #include <kernel/dev/oom.h>
 #include <kernel/sched/kernel_thread.h>
 
@@ -28,8 +29,6 @@ extern pid_t pid_max;
 
 */
 
-extern struct list buddy_free_list[BUDDY_MAX_ORDER];
-
 struct oom_info {
     int oom_score;
 };
@@ -127,35 +126,12 @@ void oom_kill(uint64_t free_memory)
 }
 
 /*
- * Get the total amount of free memory in the buddy free list 
- * by combining the size of all orders
+ * Get the total amount of free memory in bytes, as tracked by the free
+ * counters of the buddy allocator.
  */
 uint64_t get_total_free_memory(void)
 {
-    uint64_t free_memory, total_free_memory = 0;
-    int cnt_per_order;
-    struct list *node;
-
-    physaddr_t pa_max = 0, pa;
-
-	for (size_t order = 0; order < BUDDY_MAX_ORDER; ++order) {
-
-        cnt_per_order = 0;
-        list_foreach(&buddy_free_list[order], node) {
-            cnt_per_order++;
-
-            struct page_info *page;
-            page = container_of(node, struct page_info, pp_node);
-            pa = page2pa(page);
-            if (pa > pa_max)
-                pa_max = pa;
-        }
-
-        free_memory = (1 << order) * cnt_per_order * PAGE_SIZE;
-        total_free_memory += free_memory;
-    }
-
-    return free_memory;
+    return (uint64_t)count_total_free_pages() * PAGE_SIZE;
 }
 
 void oom_thread(void) 
@@ -177,6 +153,12 @@ void oom_thread(void)
 
     free_memory = get_total_free_memory();
     debug_print("(CPU %d) Free memory: %d / %d\n", this_cpu->cpu_id, free_memory, MEMORY_THRESHOLD);
+
+    // Give back the empty slabs before killing anything
+    if (free_memory < MEMORY_THRESHOLD && kmem_shrink() > 0) {
+        free_memory = get_total_free_memory();
+    }
+
     if (free_memory < MEMORY_THRESHOLD) {
         // Under memory pressure: kill the task with highest OOM score
         oom_kill(free_memory);
@@ -170,7 +170,7 @@ struct pci_dev *alloc_mmio_dev(uint32_t base_addr, size_t bus, size_t slot,
 	addr.slot = slot;
 	addr.bus = bus;
 
-	dev = kmalloc(sizeof *dev);
+	dev = kzalloc(sizeof *dev);
 
 	if (!dev) {
 		return NULL;
@@ -198,7 +198,7 @@ struct pci_dev *alloc_io_dev(size_t bus, size_t slot, size_t func)
 	addr.bus = bus;
 	addr.enable = 1;
 
-	dev = kmalloc(sizeof *dev);
+	dev = kzalloc(sizeof *dev);
 
 	if (!dev) {
 		return NULL;
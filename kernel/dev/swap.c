@@ -5,6 +5,8 @@
 #include <vma.h>
 
 #include <kernel/mem/buddy.h>
+#include <kernel/mem/kmem.h>
+#include <kernel/mem/thp.h>
 #include <kernel/mem/walk.h>
 #include <kernel/sched/task.h>
 #include <kernel/dev/swap.h>
@@ -17,6 +19,17 @@
 #define DEBUG 1
 
 #define SWAP_BLOCK 1000
+#define SWAP_GATHER_MAX 8
+
+/*
+ * Batches the TLB flushes of the pages that got swapped out, with one gather
+ * per address space, and holds on to the pages until they have been flushed.
+ */
+struct swap_batch {
+    struct tlb_gather tlb[SWAP_GATHER_MAX];
+    size_t ntlb;
+    struct list pages;
+};
 
 extern pid_t pid_max;
 
@@ -184,7 +197,7 @@ int swap_in(physaddr_t *entry)
 
     spin_lock(&swap.lock);
 
-    swap_page = page_alloc(ALLOC_ZERO);
+    swap_page = page_alloc(ALLOC_ZERO | ALLOC_MOVABLE);
 
     if(!swap_page){
         spin_unlock(&swap.lock);
@@ -242,15 +255,69 @@ static int update_pte_swap_out(physaddr_t *entry, uintptr_t base, uintptr_t end,
         // Write the disk address
         *entry += info->disk_addr;
         info->page->pp_ref--;
+        info->va = base;
     }
 
     return 0;
 }
 
+static void swap_batch_init(struct swap_batch *batch)
+{
+    batch->ntlb = 0;
+    list_init(&batch->pages);
+}
+
+/*
+ * Flushes the gathered TLB entries of every address space and then frees the
+ * pages that were swapped out, as no CPU can access them anymore.
+ */
+static void swap_batch_flush(struct swap_batch *batch)
+{
+    struct list *node;
+    size_t i;
+
+    for (i = 0; i < batch->ntlb; ++i)
+        tlb_gather_flush(batch->tlb + i);
+
+    batch->ntlb = 0;
+
+    while ((node = list_pop(&batch->pages)))
+        page_free(container_of(node, struct page_info, swap_node));
+}
+
+/*
+ * Adds the page at va to the TLB entries to flush for the address space.
+ */
+static void swap_batch_add(struct swap_batch *batch, struct page_table *pml4,
+    uintptr_t va)
+{
+    struct tlb_gather *tlb = NULL;
+    size_t i;
+
+    for (i = 0; i < batch->ntlb; ++i) {
+        if (batch->tlb[i].pml4 == pml4) {
+            tlb = batch->tlb + i;
+            break;
+        }
+    }
+
+    if (!tlb) {
+        // Out of gathers, flush what we have so far to make room
+        if (batch->ntlb == SWAP_GATHER_MAX)
+            swap_batch_flush(batch);
+
+        tlb = batch->tlb + batch->ntlb++;
+        tlb_gather_init(tlb, pml4);
+    }
+
+    tlb_gather_add(tlb, va, va + PAGE_SIZE);
+}
+
 /*
  * Update all PTEs to point to the address on disk
  */
-void update_rmap_ptes_swap_out(struct page_info *page, physaddr_t disk_addr)
+void update_rmap_ptes_swap_out(struct page_info *page, physaddr_t disk_addr,
+    struct swap_batch *batch)
 {
     struct list *node;
     
@@ -264,12 +331,27 @@ void update_rmap_ptes_swap_out(struct page_info *page, physaddr_t disk_addr)
 		.udata = &info,
 	};
 
+    struct rmap *rmap = page->rmap;
+    struct vma *vma;
+
     debug_print("(CPU %d) Changing PTE value from physical page to disk address\n", this_cpu->cpu_id);
     rmap_walk(page, &walker);
 
+    // The VMAs that share the page map it at the same address, gather it for
+    // the TLBs of their address spaces to flush before the page gets reused
+    spin_lock(&rmap->lock);
+
+    list_foreach(&rmap->vmas, node) {
+        vma = container_of(node, struct vma, rmap_node);
+
+        if (vma->vm_base <= (void *)info.va && (void *)info.va < vma->vm_end)
+            swap_batch_add(batch, vma->task->task_pml4, info.va);
+    }
+
+    spin_unlock(&rmap->lock);
 }
 
-int swap_out(void)
+int swap_out(struct swap_batch *batch)
 {
     struct disk *disk;
     struct page_info *swap_page;
@@ -296,9 +378,10 @@ int swap_out(void)
         return -1;
 
     // Update all PTEs from the rmap
-    update_rmap_ptes_swap_out(swap_page, disk_addr);
+    update_rmap_ptes_swap_out(swap_page, disk_addr, batch);
     
-    page_free(swap_page);
+    // The page is off the swap list, keep it until the TLBs have been flushed
+    list_add(&batch->pages, &swap_page->swap_node);
     
     return 0;
 }
@@ -319,6 +402,7 @@ void yield_swap(void)
 
 void swap_thread(void) 
 {
+    struct swap_batch batch;
     struct task *task;
     uint64_t free_memory;
 
@@ -338,13 +422,24 @@ void swap_thread(void)
     free_memory = get_total_free_memory();
     debug_print("(CPU %d) Free memory: %d / %d\n", this_cpu->cpu_id, free_memory, MEMORY_THRESHOLD);
     if (free_memory < MEMORY_THRESHOLD) {
-        // Under memory pressure: kill the task with highest OOM score
+        // Under memory pressure: first shrink the slab allocators and
+        // split up huge pages, such that they can be swapped out
+        kmem_shrink();
+        thp_split_tasks();
+
         debug_print("(CPU %d) Starting swap out\n", this_cpu->cpu_id);
+        swap_batch_init(&batch);
+
         for (int i = 0; i < SWAP_BLOCK; ++i) {
-            // If disk is busy, don't block - switch task
-            if (swap_out() < 0) 
+            // If disk is busy, don't block - switch task, but flush first
+            // as yielding starts over with a fresh stack
+            if (swap_out(&batch) < 0) {
+                swap_batch_flush(&batch);
                 yield_swap();
+            }
         }
+
+        swap_batch_flush(&batch);
     }
 
     yield_swap();
@@ -57,6 +57,7 @@ void kmain(struct boot_info *boot_info)
 	pic_init();
 	rsdp = rsdp_find();
 	madt_init(rsdp);
+	numa_init(rsdp);
 	lapic_init();
 	hpet_init(rsdp);
 	pci_init(rsdp);
@@ -85,12 +86,18 @@ void kmain(struct boot_info *boot_info)
 	mem_init_mp();
 	boot_cpus();
 
+	/* Free the rest of the memory together with the other CPUs. */
+	page_init_deferred();
+
 	//create_kernel_thread((uint64_t) &oom_thread);
 
 	create_kernel_thread((uint64_t) &swap_thread);
+	create_kernel_thread((uint64_t) &compact_thread);
+	create_kernel_thread((uint64_t) &thp_thread);
 
 	sched_yield();
 #else
+	page_init_deferred();
 	lab3_check_kmem();
 
 	/* Drop into the kernel monitor. */
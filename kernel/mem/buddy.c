@@ -4,6 +4,7 @@
 #include <spinlock.h>
 #include <string.h>
 #include <cpu.h>
+#include <x86-64/asm.h>
 #include <kernel/sched/task.h>
 #include <kernel/sched/kernel_thread.h>
 #include <kernel/dev/oom.h>
@@ -12,7 +13,7 @@
 
 #include <kernel/mem.h>
 
-#define DEBUG 1 
+#define DEBUG 0 
 
 char POISON[] = "&cC3ee48bKPP&jPkBWkFd!udF2%3Wae&Ra7Az8739b&d8UX*rr94oV%&3EM^BL#@3zgydFLiJT^L^X9!%8HW*@XnpkfH4YSYagXH";
 
@@ -23,12 +24,27 @@ size_t npages;
 struct page_info *pages;
 
 /*
- * List of free buddy chunks (often also referred to as buddy pages or simply
- * pages). Each order has a list containing all free buddy chunks of the
- * specific buddy order. Buddy orders go from 0 to BUDDY_MAX_ORDER - 1
+ * The buddy free lists of each NUMA node, protected by the buddy lock. Without
+ * NUMA information all memory is in the zone of node 0.
  */
-struct list buddy_free_list[BUDDY_MAX_ORDER];
-struct list zero_list;
+struct buddy_zone buddy_zones[MAX_NUMNODES];
+
+/*
+ * Order-0 pages move between the per-CPU page caches and the buddy free lists
+ * in batches of PAGE_CACHE_BATCH pages. A page cache that grows beyond
+ * PAGE_CACHE_HIGH pages gets drained by one batch.
+ */
+#define PAGE_CACHE_BATCH 16
+#define PAGE_CACHE_HIGH  (4 * PAGE_CACHE_BATCH)
+
+/*
+ * While idle, each CPU zeroes free pages until its pool of pre-zeroed pages
+ * holds PAGE_ZERO_HIGH pages of each mobility type, but only as long as the
+ * buddy allocator has more than PAGE_ZERO_MIN_FREE free pages left for
+ * everyone else.
+ */
+#define PAGE_ZERO_HIGH     64
+#define PAGE_ZERO_MIN_FREE 4096
 
 #ifndef USE_BIG_KERNEL_LOCK
 /* Lock for the buddy allocator. */
@@ -59,11 +75,13 @@ void unlock_buddy(void)
 */
 void debug_buddy_free_list() {
 
-	size_t order;
+	size_t nid, mt, order;
 	struct list *head, *node, *prev, *next;
 
+	for (nid = 0; nid < nnodes; ++nid)
+	for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt)
 	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		head = &buddy_free_list[order];
+		head = &buddy_zones[nid].free_list[mt][order];
 
 		for (node = head->next; node && node != head; node = node->next) {
 			prev = node->prev;
@@ -79,18 +97,18 @@ void debug_buddy_free_list() {
 */
 size_t debug_count_free_pages(size_t order)
 {
-	struct list *node;
+	struct list *node, *head;
 	size_t nfree_pages = 0;
 
 	if (order >= BUDDY_MAX_ORDER) {
 		return 0;
 	}
 
-	node = &buddy_free_list[order];
+	head = &buddy_zones[0].free_list[MIGRATE_UNMOVABLE][order];
 
 	int i = 0;
 	struct list *tmp;
-	for (node = (buddy_free_list + order)->next; node != (buddy_free_list + order); node = node->next) {
+	for (node = head->next; node != head; node = node->next) {
 		cprintf("\t%d\n", i);
 		i+=1;
 		++nfree_pages;
@@ -126,20 +144,17 @@ void debug_show_buddy_info(void)
  */
 size_t count_free_pages(size_t order)
 {
-	struct list *node;
-	size_t nfree_pages = 0;
+	size_t nid, nfree = 0;
 
 	if (order >= BUDDY_MAX_ORDER) {
 		return 0;
 	}
 
-	node = &buddy_free_list[order];
-
-	list_foreach(buddy_free_list + order, node) {
-		++nfree_pages;
+	for (nid = 0; nid < nnodes; ++nid) {
+		nfree += buddy_zones[nid].nfree[order];
 	}
 
-	return nfree_pages;
+	return nfree;
 }
 
 /* Shows the number of free pages in the buddy allocator as well as the amount
@@ -151,7 +166,7 @@ void show_buddy_info(void)
 {
 	struct page_info *page;
 	struct list *node;
-	size_t order;
+	size_t order, nid;
 	size_t nfree_pages;
 	size_t nfree = 0;
 
@@ -169,7 +184,7 @@ void show_buddy_info(void)
 
 		if (0) {
 			cprintf("\t");
-			struct list *head = &buddy_free_list[order];
+			struct list *head = &buddy_zones[0].free_list[MIGRATE_UNMOVABLE][order];
 			cprintf("(%p) --> ", head);
 			node = head;
 			for (int i = 0; i < 10; ++i) {
@@ -185,20 +200,22 @@ void show_buddy_info(void)
 		}
 
 		// Print physical addresses of page metadata in the free list
-		if (1) {
-			cprintf("\t");
-			struct list *head = &buddy_free_list[order];
-			cprintf("(%p) --> ", head);
-			for (node = head->next; node && node != head; node = node->next) {
-				cprintf("%p | ", node);
+		if (DEBUG) {
+			for (int mt = 0; mt < NR_MIGRATE_TYPES; ++mt) {
+				cprintf("\t");
+				struct list *head = &buddy_zones[0].free_list[mt][order];
+				cprintf("(%p) --> ", head);
+				for (node = head->next; node && node != head; node = node->next) {
+					cprintf("%p | ", node);
+				}
+				cprintf("\n");
 			}
-			cprintf("\n");
 		}
 
 		// Print physical addresses of pages in the free list
 		if (0) {
 			cprintf("\t");
-			struct list *head = &buddy_free_list[order];
+			struct list *head = &buddy_zones[0].free_list[MIGRATE_UNMOVABLE][order];
 			for (node = head->next; node && node != head; node = node->next) {
 				cprintf("%p | ", page2pa(container_of(node, struct page_info, pp_node)));
 			}
@@ -215,28 +232,66 @@ void show_buddy_info(void)
 		nfree += nfree_pages * (1 << (order + 12));
 	}
 
+	for (nid = 0; nnodes > 1 && nid < nnodes; ++nid) {
+		cprintf("  node #%u pages=%u\n", nid,
+			buddy_zones[nid].nfree_pages);
+	}
+
+	nfree_pages = count_cached_pages();
+	cprintf("  cached pages=%u\n", nfree_pages);
+	nfree += nfree_pages * PAGE_SIZE;
+
 	cprintf("  free: %u kiB\n", nfree / 1024);
 }
 
-/* Gets the total amount of free pages. */
+/* Gets the total amount of free pages, including the pages held by the
+ * per-CPU page caches.
+ */
 size_t count_total_free_pages(void)
 {
-	struct page_info *page;
-	struct list *node;
-	size_t order;
-	size_t nfree_pages;
-	size_t nfree = 0;
+	size_t nid, nfree = 0;
 
-	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		nfree_pages = count_free_pages(order);
-		nfree += nfree_pages * (1 << order);
+	for (nid = 0; nid < nnodes; ++nid) {
+		nfree += buddy_zones[nid].nfree_pages;
 	}
 
-	return nfree;
+	return nfree + count_cached_pages();
+}
+
+/* Gets the buddy zone of the NUMA node that the page belongs to. */
+static inline struct buddy_zone *page_zone(struct page_info *page)
+{
+	return &buddy_zones[page->pp_nid];
+}
+
+/* Adds the free chunk page to the free list of its order in the zone of its
+ * node and accounts for it in the free counters. The caller must hold the
+ * buddy lock.
+ */
+static void buddy_list_add(struct page_info *page)
+{
+	struct buddy_zone *zone = page_zone(page);
+
+	list_add(&zone->free_list[page_blocktype(page)][page->pp_order],
+		&page->pp_node);
+	++zone->nfree[page->pp_order];
+	zone->nfree_pages += 1 << page->pp_order;
+}
+
+/* Removes the free chunk page from the free list of its order and from the
+ * free counters. The caller must hold the buddy lock.
+ */
+static void buddy_list_del(struct page_info *page)
+{
+	struct buddy_zone *zone = page_zone(page);
+
+	list_del(&page->pp_node);
+	--zone->nfree[page->pp_order];
+	zone->nfree_pages -= 1 << page->pp_order;
 }
 
 /* Splits lhs into free pages until the order of the page is the requested
- * order req_order.
+ * order req_order. The page lhs must not be on a free list.
  *
  * The algorithm to split pages is as follows:
  *  - Given the page of order k, locate the page and its buddy at order k - 1.
@@ -246,238 +301,763 @@ size_t count_total_free_pages(void)
  *
  * Returns a page of the requested order.
  */
- struct page_info *buddy_split(struct page_info *lhs, size_t req_order)
+struct page_info *buddy_split(struct page_info *lhs, size_t req_order)
 {
-	/* LAB 1: your code here. */
-	
-	//	if order is the same just return the page with the requested order
-	if(lhs->pp_order == req_order){
-		return lhs;
-	}
-
-	// block_size = 2^pp_order
-	size_t block_size = 1 << lhs->pp_order;
-
-	// Find buddy
-	int page_index = page2pa(lhs) / PAGE_SIZE; 
-	int buddy_index = page_index + block_size / 2;
 	struct page_info *buddy;
 
-	buddy = pages + buddy_index;
-	
-	list_del(&lhs->pp_node);
-
-	// Decrement order of buddy page
-	lhs->pp_order -= 1;
-	buddy->pp_order = lhs->pp_order;
+	while (lhs->pp_order > req_order) {
+		// Decrement the order of the page and find its buddy
+		lhs->pp_order -= 1;
+		buddy = lhs + (1 << lhs->pp_order);
+		buddy->pp_order = lhs->pp_order;
 
-	// Mark buddy page to free
-	buddy->pp_free = 1;
-	
-	// Add buddy page to the free list
-	struct list *head = &buddy_free_list[lhs->pp_order];
-	list_add(head, &lhs->pp_node);
-	list_add(head, &buddy->pp_node);
+		// Mark buddy page as free and add it to the free list
+		buddy->pp_free = 1;
+		buddy_list_add(buddy);
+	}
 
-	return buddy_split(lhs, req_order);
+	return lhs;
 }
 
 /* Merges the buddy of the page with the page if the buddy is free to form
  * larger and larger free pages until either the maximum order is reached or
- * no free buddy is found.
+ * no free buddy is found. Pages of different NUMA nodes are never merged. The
+ * page must not be on a free list.
  *
  * The algorithm to merge pages is as follows:
  *  - Given the page of order k, locate the page with the lowest address
  *    and its buddy of order k.
  *  - Check if both the page and the buddy are free and whether the order
  *    matches.
- *  - Remove the page and its buddy from the free list.
+ *  - Remove the buddy from the free list.
  *  - Increment the order of the page.
  *  - Repeat until the maximum order has been reached or until the buddy is not
  *    free.
  *
- * Returns the largest merged free page possible.
+ * Returns the largest merged free page possible, which is not on a free list.
  */
 struct page_info *buddy_merge(struct page_info *page)
 {
-	/* LAB 1: your code here. */
-	int i;
-	int page_index, buddy_index;
 	struct page_info *lhs, *buddy;
-	size_t block_size = 1 << page->pp_order;
-	
-	page_index = page2pa(page) / PAGE_SIZE; 
+	size_t page_index, block_size;
 
-	if (page->pp_order == BUDDY_MAX_ORDER - 1)
-		return NULL; 
+	while (page->pp_order < BUDDY_MAX_ORDER - 1) {
+		// Nothing to merge with if there are no free chunks of this order
+		if (!page_zone(page)->nfree[page->pp_order]) {
+			break;
+		}
 
-	// Add page to free list without merging if the list is empty
-    struct list *head = &buddy_free_list[page->pp_order];
-    if (list_is_empty(head)) {
-		return page;
-	}
+		// Determine if buddy is on the left or right side
+		block_size = 1 << page->pp_order;
+		page_index = page - pages;
 
-	// Find buddy of our page
+		if (page_index % (block_size * 2) == 0) {
+			buddy = page + block_size;
+			lhs = page;
+		} else {
+			buddy = page - block_size;
+			lhs = buddy;
+		}
 
-	// Determine if buddy is on the left or right side
-	if (page_index % (block_size * 2) == 0) {
-		// Buddy is on the right side
-	 	buddy = &pages[page_index + block_size];
-		lhs = page;
-	} else {
-		// Buddy is on the left side
-	 	buddy = &pages[page_index - block_size];
-		lhs = buddy;
-	}
-	buddy_index = PAGE_INDEX(page2pa(buddy));
+		// Check if buddy is free, the same order as our page and on the
+		// same node
+		if (!buddy->pp_free || buddy->pp_order != page->pp_order ||
+		    buddy->pp_nid != page->pp_nid) {
+			break;
+		}
 
-	// Check if buddy is free and the same order as our page
-	if (page->pp_free && buddy->pp_free && page->pp_order == buddy->pp_order) {
-		// Remove page and buddy from lower order
-		list_del(&buddy->pp_node);
-		list_del(&page->pp_node);
+		buddy_list_del(buddy);
 
-		// Set rhs pages to not-free	
+		// Set rhs page to not-free
 		if (buddy == lhs)
 			page->pp_free = 0;
 		else
 			buddy->pp_free = 0;
 
-		// Move new merged block to higher order
+		// Continue with the merged block at the higher order
 		lhs->pp_order += 1;
-		page_index = PAGE_INDEX(page2pa(lhs));
-		head = &buddy_free_list[lhs->pp_order];
-		list_add(head, &lhs->pp_node);
+		page = lhs;
+	}
+
+	return page;
+}
+
+/* Changes the mobility type of the 2M page block that the page is in and moves
+ * the free chunks in the block to the free lists of that type. The caller must
+ * hold the buddy lock.
+ */
+static void buddy_claim_block(struct page_info *page, int migratetype)
+{
+	struct page_info *block = page_block(page), *chunk;
+	size_t i, n = MIN(1 << BUDDY_2M_PAGE, npages - (block - pages));
 
-		page = buddy_merge(lhs);
+	if (block->pp_blocktype == migratetype) {
+		return;
+	}
 
-		return NULL;
-	} 
-	
-	return page; 
+	block->pp_blocktype = migratetype;
+
+	for (i = 0; i < n; ) {
+		chunk = block + i;
+
+		if (!chunk->pp_free) {
+			++i;
+			continue;
+		}
+
+		buddy_list_del(chunk);
+		buddy_list_add(chunk);
+		i += 1 << chunk->pp_order;
+	}
 }
 
 /* Given the order req_order, attempts to find a page of that order or a larger
- * order in the free list. In case the order of the free page is larger than the
- * requested order, the page is split down to the requested order using
- * buddy_split().
+ * order in the free lists of the given zone and mobility type. In case the
+ * order of the free page is larger than the requested order, the page is split
+ * down to the requested order using buddy_split().
+ *
+ * If there are no free pages of the requested mobility type, a page is taken
+ * from the free lists of the other type, starting with the largest chunk, such
+ * that as few blocks as possible end up with mixed allocations. If the chunk
+ * covers a large part of its 2M page block, the entire block changes type.
  *
- * Returns a page of the requested order or NULL if no such page can be found.
+ * Returns a page of the requested order that has been taken off the free list
+ * or NULL if no such page can be found.
  */
-struct page_info *buddy_find(size_t req_order)
+static struct page_info *buddy_zone_find(struct buddy_zone *zone,
+	size_t req_order, int migratetype)
 {
 	struct page_info *page;
-	struct list *head;
-	
-	//	if the list of the requested order is not empty pop and return it
-	if(!list_is_empty(&buddy_free_list[req_order])) {
-		page = (struct page_info *) list_pop(&buddy_free_list[req_order]);
-		return page;
-	}
-	//	otherwise we are gonna go through all orders, pop the page of the valid order and return buddy
-	for (size_t order = req_order + 1; order < BUDDY_MAX_ORDER; ++order) {
-		head = &buddy_free_list[order];
-		if (list_is_empty(head))
+	struct list *node;
+	size_t order;
+	int mt;
+
+	for (order = req_order; order < BUDDY_MAX_ORDER; ++order) {
+		if ((node = list_head(&zone->free_list[migratetype][order])))
+			goto found;
+	}
+
+	for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt) {
+		if (mt == migratetype)
 			continue;
-		page = (struct page_info *) list_pop(&buddy_free_list[order]);
-		return buddy_split(page, req_order);
+
+		for (order = BUDDY_MAX_ORDER; order-- > req_order; ) {
+			if (!(node = list_head(&zone->free_list[mt][order])))
+				continue;
+
+			if (order >= BUDDY_2M_PAGE / 2) {
+				buddy_claim_block(container_of(node,
+					struct page_info, pp_node), migratetype);
+			}
+
+			goto found;
+		}
 	}
 
 	return NULL;
+
+found:
+	page = container_of(node, struct page_info, pp_node);
+	buddy_list_del(page);
+
+	return buddy_split(page, req_order);
 }
 
-/*
- * Allocates a physical page.
+/* Given the order req_order, attempts to find a free page of that order and
+ * mobility type, preferring the zone of the NUMA node of the current CPU and
+ * falling back to the zones of the other nodes in the order of their distance.
  *
- * if (alloc_flags & ALLOC_ZERO), fills the entire returned physical page with
- * '\0' bytes.
- * if (alloc_flags & ALLOC_HUGE), returns a huge physical 2M page.
- *
- * Beware: this function does NOT increment the reference count of the page -
- * this is the caller's responsibility.
- *
- * Returns NULL if out of free memory.
- *
- * Hint: use buddy_find() to find a free page of the right order.
- * Hint: use page2kva() and memset() to clear the page.
+ * Returns a page of the requested order that has been taken off the free list
+ * or NULL if no such page can be found.
  */
-struct page_info *page_alloc(int alloc_flags)
+struct page_info *buddy_find(size_t req_order, int migratetype)
 {
-	/* LAB 1: your code here. */
 	struct page_info *page;
-	uint64_t addr;
+	uint8_t *fallback = node_fallback[this_cpu->cpu_nid];
+	size_t i;
+
+	for (i = 0; i < nnodes; ++i) {
+		page = buddy_zone_find(&buddy_zones[fallback[i]], req_order,
+			migratetype);
+
+		if (page) {
+			return page;
+		}
+	}
+
+	return NULL;
+}
+
+/* Takes a snapshot of the free memory statistics of the buddy allocator. */
+void buddy_get_stats(struct buddy_stats *stats)
+{
+	struct buddy_zone *zone;
+	size_t nid, order;
+
+	memset(stats, 0, sizeof *stats);
 
 	lock_buddy();
 
-	// Find a page of order 0
-	page = buddy_find(0);
+	for (nid = 0; nid < nnodes; ++nid) {
+		zone = &buddy_zones[nid];
+
+		for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+			stats->nfree[order] += zone->nfree[order];
+		}
+
+		stats->node_nfree_pages[nid] = zone->nfree_pages;
+		stats->nfree_pages += zone->nfree_pages;
+	}
 
-	assert(page);
+	unlock_buddy();
+
+	stats->nnodes = nnodes;
+
+	stats->ncached_pages = count_cached_pages();
+}
 
+/* Marks a page found on the buddy free lists as in use. */
+static struct page_info *buddy_take(struct page_info *page)
+{
 	if (!page) {
-		unlock_buddy();
 		return NULL;
 	}
 
 	assert(page->pp_free == 1);
-		
-	// Initialize to zero if the flag is set
-	addr = (uint64_t) page2kva(page);
-	if (alloc_flags & ALLOC_ZERO) {
-		// Zero the page if not yet done
-		if (!page->pp_zero)
-			memset((void *) addr, '\0', PAGE_SIZE);
-	}
 
 	// Remove page from free list
 	page->pp_free = 0;
 	list_del(&page->pp_node);
 
+	return page;
+}
+
+/* Takes a free block of 2^order pages off the buddy free lists and marks it
+ * as in use. The caller must hold the buddy lock.
+ *
+ * Returns NULL if the buddy allocator has no block of at least that order.
+ */
+static struct page_info *buddy_alloc(size_t order, int migratetype)
+{
+	return buddy_take(buddy_find(order, migratetype));
+}
+
+/* Returns a page to the buddy free lists, merging it with its buddies. The
+ * caller must hold the buddy lock.
+ */
+void buddy_free_page(struct page_info *pp)
+{
+	// Merge the page with its buddies and add it to the free list
+	pp->pp_free = 1;
+	pp = buddy_merge(pp);
+	buddy_list_add(pp);
+}
+
+/* Takes the free chunk page off the buddy free lists without splitting it and
+ * marks it as in use, such that it cannot be allocated or merged with. Used by
+ * compaction to claim the free chunks of a block. The caller must hold the
+ * buddy lock.
+ */
+void buddy_isolate(struct page_info *page)
+{
+	assert(page->pp_free == 1);
+
+	buddy_list_del(page);
+	page->pp_free = 0;
+}
+
+/* Moves up to n pages of the given mobility type from the buddy free lists
+ * into the page cache. The caller must have interrupts disabled.
+ */
+static void page_cache_refill(struct page_cache *cache, int mt, size_t n)
+{
+	struct page_info *page;
+
+	lock_buddy();
+
+	while (n--) {
+		page = buddy_alloc(0, mt);
+
+		if (!page) {
+			break;
+		}
+
+		list_add_tail(&cache->pages[mt], &page->pp_node);
+		++cache->count[mt];
+	}
+
+	unlock_buddy();
+}
+
+/* Moves up to n pages of the given mobility type from the page cache back to
+ * the buddy free lists, starting with the pages that have been in the cache the
+ * longest. The caller must have interrupts disabled.
+ */
+static void page_cache_drain_pages(struct page_cache *cache, int mt, size_t n)
+{
+	struct page_info *page;
+	struct list *node;
+
+	lock_buddy();
+
+	while (n-- && (node = list_pop_tail(&cache->pages[mt]))) {
+		page = container_of(node, struct page_info, pp_node);
+		--cache->count[mt];
+		buddy_free_page(page);
+	}
+
+	unlock_buddy();
+}
+
+/* Moves up to n pages of the given mobility type from the pool of pre-zeroed
+ * pages back to the buddy free lists. The caller must have interrupts
+ * disabled.
+ */
+static void page_cache_drain_zeroed(struct page_cache *cache, int mt, size_t n)
+{
+	struct page_info *page;
+	struct list *node;
+
+	lock_buddy();
+
+	while (n-- && (node = list_pop_tail(&cache->zeroed[mt]))) {
+		page = container_of(node, struct page_info, pp_node);
+		--cache->nzeroed[mt];
+
+		// Only pages in the pool of pre-zeroed pages are marked as zeroed
+		page->pp_zero = 0;
+		buddy_free_page(page);
+	}
+
 	unlock_buddy();
+}
+
+/* Sets up the page cache of the current CPU. Until this has been called, the
+ * CPU allocates and frees all pages through the buddy free lists directly.
+ */
+void page_cache_init(void)
+{
+	struct page_cache *cache = &this_cpu->page_cache;
+	int mt;
+
+	for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt) {
+		list_init(&cache->pages[mt]);
+		list_init(&cache->zeroed[mt]);
+		cache->count[mt] = 0;
+		cache->nzeroed[mt] = 0;
+	}
+
+	cache->enabled = 1;
+}
+
+/* Returns all pages in the page cache of the current CPU to the buddy free
+ * lists, e.g. to make them available for merging.
+ */
+void page_cache_drain(void)
+{
+	struct page_cache *cache;
+	uint64_t rflags;
+	int mt;
+
+	rflags = irq_save();
+	cache = &this_cpu->page_cache;
+
+	if (cache->enabled) {
+		for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt) {
+			page_cache_drain_pages(cache, mt, cache->count[mt]);
+			page_cache_drain_zeroed(cache, mt, cache->nzeroed[mt]);
+		}
+	}
+
+	irq_restore(rflags);
+}
+
+/* Gets the number of free pages held by the page caches of all CPUs. */
+size_t count_cached_pages(void)
+{
+	size_t i, ncached = 0;
+	int mt;
+
+	for (i = 0; i < NCPUS; ++i) {
+		for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt) {
+			ncached += cpus[i].page_cache.count[mt];
+			ncached += cpus[i].page_cache.nzeroed[mt];
+		}
+	}
+
+	return ncached;
+}
+
+/* Allocates an order-0 page from the page cache of the current CPU, refilling
+ * the cache from the buddy free lists in a single batch when it runs empty.
+ * Requests for ALLOC_ZERO are served from the pool of pre-zeroed pages first,
+ * while other requests only fall back to that pool when out of memory.
+ *
+ * Returns NULL if the page cache is not enabled or if both the page cache and
+ * the buddy allocator are out of pages.
+ */
+static struct page_info *page_cache_alloc(int alloc_flags)
+{
+	struct page_cache *cache;
+	struct list *node = NULL;
+	uint64_t rflags;
+	int mt = alloc_migratetype(alloc_flags);
+
+	rflags = irq_save();
+	cache = &this_cpu->page_cache;
+
+	if (!cache->enabled) {
+		goto out;
+	}
+
+	if ((alloc_flags & ALLOC_ZERO) && (node = list_pop(&cache->zeroed[mt]))) {
+		--cache->nzeroed[mt];
+		goto out;
+	}
+
+	if (!cache->count[mt]) {
+		page_cache_refill(cache, mt, PAGE_CACHE_BATCH);
+	}
+
+	// Hand out the most recently freed page, it is likely still cached
+	if ((node = list_pop(&cache->pages[mt]))) {
+		--cache->count[mt];
+	} else if ((node = list_pop(&cache->zeroed[mt]))) {
+		--cache->nzeroed[mt];
+	}
+
+out:
+
+	irq_restore(rflags);
+
+	return node ? container_of(node, struct page_info, pp_node) : NULL;
+}
+
+/* Frees an order-0 page to the page cache of the current CPU, draining a batch
+ * of pages back to the buddy free lists once the cache grows too large. The
+ * page goes to the list of the mobility type of its page block.
+ *
+ * Pages of a remote NUMA node bypass the cache, such that the cache only hands
+ * out local pages.
+ *
+ * Returns 0 if the page cache is not enabled or the page is remote, 1
+ * otherwise.
+ */
+static int page_cache_free(struct page_info *pp)
+{
+	struct page_cache *cache;
+	uint64_t rflags;
+	int ret = 0, mt = page_blocktype(pp);
+
+	rflags = irq_save();
+	cache = &this_cpu->page_cache;
+
+	if (cache->enabled && pp->pp_nid == this_cpu->cpu_nid) {
+		list_add_tail(&cache->pages[mt], &pp->pp_node);
+		++cache->count[mt];
+
+		if (cache->count[mt] > PAGE_CACHE_HIGH) {
+			page_cache_drain_pages(cache, mt, PAGE_CACHE_BATCH);
+		}
+
+		ret = 1;
+	}
+
+	irq_restore(rflags);
+
+	return ret;
+}
+
+/* Clears a page using the fast string instructions, which write entire cache
+ * lines at a time.
+ */
+static void page_zero(struct page_info *page)
+{
+	void *kva = page2kva(page);
+	size_t n = PAGE_SIZE / sizeof(uint64_t);
+
+	asm volatile("cld; rep stosq\n"
+		: "+D" (kva), "+c" (n)
+		: "a" (0)
+		: "cc", "memory");
+}
+
+/* Refills the pool of pre-zeroed pages of the current CPU by one batch. This is
+ * called from the scheduler when the CPU has nothing else to do. The pages are
+ * taken off the free lists of the local NUMA node in one go and then zeroed
+ * without holding the buddy lock. The mobility type with the fewest pre-zeroed
+ * pages gets refilled first.
+ */
+void page_zero_idle(void)
+{
+	struct page_cache *cache;
+	struct buddy_zone *zone;
+	struct page_info *page;
+	struct list batch, *node;
+	size_t n;
+	uint64_t rflags;
+	int mt;
+
+	rflags = irq_save();
+	cache = &this_cpu->page_cache;
+	zone = &buddy_zones[this_cpu->cpu_nid];
+	mt = cache->nzeroed[MIGRATE_MOVABLE] <= cache->nzeroed[MIGRATE_UNMOVABLE] ?
+		MIGRATE_MOVABLE : MIGRATE_UNMOVABLE;
+
+	if (!cache->enabled || cache->nzeroed[mt] >= PAGE_ZERO_HIGH ||
+	    zone->nfree_pages < PAGE_ZERO_MIN_FREE) {
+		irq_restore(rflags);
+		return;
+	}
+
+	list_init(&batch);
+	n = MIN(PAGE_CACHE_BATCH, PAGE_ZERO_HIGH - cache->nzeroed[mt]);
+
+	lock_buddy();
+
+	while (n--) {
+		page = buddy_take(buddy_zone_find(zone, 0, mt));
+
+		if (!page) {
+			break;
+		}
+
+		list_add_tail(&batch, &page->pp_node);
+	}
+
+	unlock_buddy();
+
+	while ((node = list_pop(&batch))) {
+		page = container_of(node, struct page_info, pp_node);
+		page_zero(page);
+		page->pp_zero = 1;
+
+		list_add_tail(&cache->zeroed[mt], &page->pp_node);
+		++cache->nzeroed[mt];
+	}
+
+	irq_restore(rflags);
+}
+
+/*
+ * Allocates a naturally aligned block of 2^order physical pages. Orders up to
+ * BUDDY_MAX_ORDER - 1 (i.e. 2M pages) are supported.
+ *
+ * if (alloc_flags & ALLOC_ZERO), fills the entire returned block with '\0'
+ * bytes.
+ * if (alloc_flags & ALLOC_MOVABLE), the block can be migrated by compaction and
+ * is taken from a page block for movable pages.
+ *
+ * Beware: this function does NOT increment the reference count of the page -
+ * this is the caller's responsibility.
+ *
+ * Returns NULL if out of free memory.
+ *
+ * Order-0 pages are taken from the page cache of the current CPU, such that
+ * the buddy lock is only taken once per batch of pages.
+ */
+struct page_info *page_alloc_order(size_t order, int alloc_flags)
+{
+	struct page_info *page = NULL;
+
+	if (order >= BUDDY_MAX_ORDER) {
+		return NULL;
+	}
+
+	if (order == 0) {
+		page = page_cache_alloc(alloc_flags);
+	}
+
+	if (!page) {
+		lock_buddy();
+		page = buddy_alloc(order, alloc_migratetype(alloc_flags));
+		unlock_buddy();
+	}
+
+	// Try to free up a huge page by migrating pages out of a few
+	// fragmented 2M blocks. Other allocations may be made with locks held
+	// and leave compaction to the compaction thread.
+	if (!page && (alloc_flags & ALLOC_HUGE) &&
+	    compact_memory(COMPACT_DIRECT)) {
+		lock_buddy();
+		page = buddy_alloc(order, alloc_migratetype(alloc_flags));
+		unlock_buddy();
+	}
+
+	if (!page) {
+		return NULL;
+	}
+
+	// Initialize to zero if the flag is set, unless the page came from the
+	// pool of pre-zeroed pages
+	if ((alloc_flags & ALLOC_ZERO) && !page->pp_zero) {
+		memset(page2kva(page), '\0', PAGE_SIZE << order);
+	}
+
+	page->pp_zero = 0;
 
 	return page;
 }
 
+/*
+ * Allocates a physical page.
+ *
+ * if (alloc_flags & ALLOC_ZERO), fills the entire returned physical page with
+ * '\0' bytes.
+ * if (alloc_flags & ALLOC_HUGE), returns a huge physical 2M page.
+ * if (alloc_flags & ALLOC_MOVABLE), the page can be migrated by compaction.
+ *
+ * Beware: this function does NOT increment the reference count of the page -
+ * this is the caller's responsibility.
+ *
+ * Returns NULL if out of free memory.
+ */
+struct page_info *page_alloc(int alloc_flags)
+{
+	if (alloc_flags & ALLOC_HUGE) {
+		return page_alloc_order(BUDDY_2M_PAGE, alloc_flags);
+	}
+
+	return page_alloc_order(BUDDY_4K_PAGE, alloc_flags);
+}
 
 /*
  * Return a page to the free list.
  * (This function should only be called when pp->pp_ref reaches 0.)
  *
- * Hint: mark the page as free and use buddy_merge() to merge the free page
- * with its buddies before returning the page to the free list.
+ * Order-0 pages go to the page cache of the current CPU and only reach the
+ * buddy free lists when the cache gets drained. Pages of a higher order are
+ * merged with their buddies right away.
  */
 void page_free(struct page_info *pp)
 {
-	struct list *head;
-	int page_index;
-
 	if (!(pp->pp_ref == 0))
 		debug_print("(CPU %d) pp_ref: %d\n", this_cpu->cpu_id, pp->pp_ref);
     assert(pp->pp_ref == 0);
 
+	// Remove page node from page replacement list
+	if (!list_is_empty(&pp->swap_node)) {
+		spin_lock(&swap.lock);
+		remove_swap_page(pp);
+		spin_unlock(&swap.lock);
+	}
+
+	// Free pages must not look movable to compaction
+	pp->rmap = NULL;
+
+	if (pp->pp_order == 0 && page_cache_free(pp)) {
+		return;
+	}
+
 	lock_buddy();
+	buddy_free_page(pp);
+	unlock_buddy();
+}
 
-	// Remove page node from page replacement list
-	remove_swap_page(pp);
+/*
+ * Return a block of 2^order pages allocated with page_alloc_order() to the
+ * free list.
+ */
+void page_free_order(struct page_info *pp, size_t order)
+{
+	assert(pp->pp_order == order);
+
+	page_free(pp);
+}
 
-	// Check if we can merge the page
-    pp->pp_free = 1;
-	if (pp->pp_order != BUDDY_MAX_ORDER - 1)
-		pp = buddy_merge(pp);
+/*
+ * Allocates n order-0 physical pages and appends them to the list through
+ * their pp_node, taking the buddy lock only once. Rather than taking the pages
+ * off the free lists one at a time, the largest blocks that fit are taken and
+ * split up into order-0 pages.
+ *
+ * The alloc_flags are the same as for page_alloc(), except ALLOC_HUGE.
+ *
+ * Beware: this function does NOT increment the reference count of the pages -
+ * this is the caller's responsibility.
+ *
+ * Returns the number of pages added to the list, which is less than n if out
+ * of free memory.
+ */
+size_t page_alloc_bulk(size_t n, int alloc_flags, struct list *list)
+{
+	struct page_info *page;
+	struct list batch, *node;
+	size_t i, order, nalloc = 0;
+	int mt = alloc_migratetype(alloc_flags);
 
-	// Add new page to free list if the merger did not already add it
-	if (!pp) {
-		unlock_buddy();
+	list_init(&batch);
+	lock_buddy();
+
+	while (nalloc < n) {
+		// Take the largest block that does not exceed the remaining pages
+		order = MIN(BUDDY_MAX_ORDER - 1, 63 - __builtin_clzll(n - nalloc));
+		page = NULL;
+
+		for (; !page && order != (size_t)-1; --order) {
+			page = buddy_alloc(order, mt);
+		}
+
+		if (!page) {
+			break;
+		}
+
+		++order;
+
+		for (i = 0; i < (1 << order); ++i) {
+			page[i].pp_order = 0;
+			page[i].pp_free = 0;
+			list_add_tail(&batch, &page[i].pp_node);
+		}
+
+		nalloc += 1 << order;
+	}
+
+	unlock_buddy();
+
+	// Clear the pages without holding the buddy lock
+	while ((node = list_pop_tail(&batch))) {
+		page = container_of(node, struct page_info, pp_node);
+
+		if (alloc_flags & ALLOC_ZERO) {
+			page_zero(page);
+		}
+
+		page->pp_zero = 0;
+		list_add_tail(list, &page->pp_node);
+	}
+
+	return nalloc;
+}
+
+/*
+ * Returns all the pages on the list, linked through their pp_node, to the free
+ * lists, taking the buddy lock only once for the entire list. The pages are
+ * freed in the order of the list, which leaves the list empty. (This function
+ * should only be called when the pp_ref of each page has reached 0.)
+ *
+ * As the pp_node shares its storage with the swap_node, the pages must have
+ * been taken off the page replacement list before they were put on the list.
+ */
+void page_free_list(struct list *list)
+{
+	struct page_info *pp;
+	struct list *node;
+
+	if (list_is_empty(list)) {
 		return;
 	}
 
-	head = &buddy_free_list[pp->pp_order];
-	page_index = page2pa(pp) / PAGE_SIZE; 
-	list_add(head, &pp->pp_node);
+	lock_buddy();
+
+	while ((node = list_pop_tail(list))) {
+		pp = container_of(node, struct page_info, pp_node);
+		assert(pp->pp_ref == 0);
 
-	// Page has not been zeroed
-	pp->pp_zero = 0;
-	list_add(&zero_list, &pp->pp_zero_node);
+		// Free pages must not look movable to compaction
+		pp->rmap = NULL;
+		buddy_free_page(pp);
+	}
 
 	unlock_buddy();
 }
@@ -516,7 +1096,7 @@ void buddy_migrate(void)
 {
 	struct page_info *page;
 	struct list *node;
-	size_t i;
+	size_t i, nid, mt;
 
 	for (i = 0; i < npages; ++i) {
 		page = pages + i;
@@ -526,8 +1106,10 @@ void buddy_migrate(void)
 		node->prev = update_ptr(node->prev);
 	}
 
+	for (nid = 0; nid < MAX_NUMNODES; ++nid)
+	for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt)
 	for (i = 0; i < BUDDY_MAX_ORDER; ++i) {
-		node = buddy_free_list + i;
+		node = buddy_zones[nid].free_list[mt] + i;
 
 		node->next = update_ptr(node->next);
 		node->prev = update_ptr(node->prev);
@@ -536,6 +1118,205 @@ void buddy_migrate(void)
 	pages = (struct page_info *)KPAGES;
 }
 
+/* Initializes the free lists of the buddy zones of all NUMA nodes. */
+void buddy_init(void)
+{
+	struct buddy_zone *zone;
+	size_t nid, mt, order;
+
+	for (nid = 0; nid < MAX_NUMNODES; ++nid) {
+		zone = &buddy_zones[nid];
+
+		for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+			for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt) {
+				list_init(zone->free_list[mt] + order);
+			}
+
+			zone->nfree[order] = 0;
+		}
+
+		zone->nfree_pages = 0;
+	}
+}
+
+/* Checks whether all pages of the free chunk belong to the same node. */
+static int buddy_chunk_single_node(struct page_info *page)
+{
+	size_t i;
+
+	for (i = 1; i < (1 << page->pp_order); ++i) {
+		if (page[i].pp_nid != page->pp_nid) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Adds the free chunk to the zone of its node, splitting it into smaller
+ * chunks first if it spans multiple nodes.
+ */
+static void buddy_add_chunk(struct page_info *page)
+{
+	struct page_info *buddy;
+
+	while (!buddy_chunk_single_node(page)) {
+		page->pp_order -= 1;
+		buddy = page + (1 << page->pp_order);
+		buddy->pp_order = page->pp_order;
+		buddy->pp_free = 1;
+		buddy_add_chunk(buddy);
+	}
+
+	buddy_list_add(page);
+}
+
+/* Tags every page with the NUMA node it belongs to and moves the free chunks
+ * from the zone of node 0 into the zone of their node. Called once the NUMA
+ * topology is known, before the other CPUs are started.
+ */
+void buddy_init_zones(void)
+{
+	struct buddy_zone *zone = &buddy_zones[0];
+	struct page_info *page;
+	struct list chunks, *node;
+	size_t i, j, mt, order;
+	size_t nblocks = 1 << (BUDDY_MAX_ORDER - 1);
+
+	page_cache_drain();
+	lock_buddy();
+
+	// Take all free chunks off the free lists of node 0
+	list_init(&chunks);
+
+	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+		for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt) {
+			while ((node = list_pop(zone->free_list[mt] + order))) {
+				list_add(&chunks, node);
+			}
+		}
+
+		zone->nfree[order] = 0;
+	}
+
+	zone->nfree_pages = 0;
+
+	// Tag the pages, skipping holes where the page structs are not mapped
+	for (i = 0; i < npages; i += nblocks) {
+		if (!page_lookup(kernel_pml4, pages + i, NULL)) {
+			continue;
+		}
+
+		for (j = i; j < MIN(i + nblocks, npages); ++j) {
+			pages[j].pp_nid = pa2nid(page2pa(pages + j));
+		}
+	}
+
+	while ((node = list_pop(&chunks))) {
+		page = container_of(node, struct page_info, pp_node);
+		buddy_add_chunk(page);
+	}
+
+	unlock_buddy();
+}
+
+/* Sets up the descriptors of the n pages starting at base and splits the
+ * pages into chunks that are as large as their alignment allows, rather than
+ * one page at a time. The chunks are added to the given list, to be handed to
+ * the buddy allocator using buddy_free_chunks(). Does not touch the free
+ * lists, such that multiple CPUs can prepare disjoint ranges at once without
+ * holding the buddy lock.
+ */
+void buddy_prepare_range(struct page_info *base, size_t n, struct list *chunks)
+{
+	struct page_info *page;
+	size_t i, j, index, order;
+
+	for (i = 0; i < n; i += 1 << order) {
+		index = base - pages + i;
+
+		for (order = BUDDY_MAX_ORDER - 1; order > 0; --order) {
+			if (index % (1 << order) == 0 && i + (1 << order) <= n) {
+				break;
+			}
+		}
+
+		for (j = 0; j < (1 << order); ++j) {
+			page = base + i + j;
+			page->rmap = NULL;
+			page->pp_ref = 0;
+			page->pp_order = 0;
+			page->pp_free = 0;
+			page->pp_zero = 0;
+			list_init(&page->pp_node);
+		}
+
+		page = base + i;
+		page->pp_order = order;
+		list_add_tail(chunks, &page->pp_node);
+	}
+}
+
+/* Hands the chunks prepared by buddy_prepare_range() to the buddy allocator,
+ * merging them with their free buddies.
+ */
+void buddy_free_chunks(struct list *chunks)
+{
+	struct page_info *page;
+	struct list *node;
+
+	if (list_is_empty(chunks)) {
+		return;
+	}
+
+	lock_buddy();
+
+	while ((node = list_pop(chunks))) {
+		page = container_of(node, struct page_info, pp_node);
+		list_init(&page->pp_node);
+		page->pp_free = 1;
+		buddy_add_chunk(buddy_merge(page));
+	}
+
+	unlock_buddy();
+}
+
+/* Tries to back the 2M of the page descriptor array around va with a single
+ * huge page, such that walking the descriptors causes fewer TLB misses. This
+ * only works if the 2M is not mapped using 4K pages already.
+ *
+ * Returns 0 if the descriptors at va are mapped by a huge page, -1 if they
+ * have to be mapped using 4K pages.
+ */
+static int buddy_map_huge(struct page_table *pml4, void *va)
+{
+	struct page_info *page;
+	physaddr_t *entry;
+
+	entry = pde_lookup(pml4, va);
+
+	if (entry && (*entry & PAGE_PRESENT)) {
+		return (*entry & PAGE_HUGE) ? 0 : -1;
+	}
+
+	page = page_alloc_order(BUDDY_2M_PAGE, ALLOC_ZERO);
+
+	if (!page) {
+		return -1;
+	}
+
+	++page->pp_ref;
+	boot_map_huge_region(pml4, ROUNDDOWN(va, HPAGE_SIZE), HPAGE_SIZE,
+		page2pa(page), PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC |
+		PAGE_GLOBAL);
+
+	return 0;
+}
+
+/* Maps the page descriptors of the 2M block of physical memory at index and
+ * initializes them. The descriptors are backed by 2M pages where possible
+ * and by 4K pages otherwise.
+ */
 int buddy_map_chunk(struct page_table *pml4, size_t index)
 {
 	struct page_info *page, *base;
@@ -551,6 +1332,10 @@ int buddy_map_chunk(struct page_table *pml4, size_t index)
 	base = pages + index;
 
 	for (i = 0; i < nalloc; ++i) {
+		if (i == 0 && buddy_map_huge(pml4, base) == 0) {
+			break;
+		}
+
 		page = page_alloc(ALLOC_ZERO);
 
 		if (!page) {
@@ -558,7 +1343,7 @@ int buddy_map_chunk(struct page_table *pml4, size_t index)
 		}
 
 		if (page_insert(pml4, page, (char *)base + i * PAGE_SIZE,
-		    PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC) < 0) {
+		    PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC | PAGE_GLOBAL) < 0) {
 			return -1;
 		}
 	}
@@ -566,9 +1351,10 @@ int buddy_map_chunk(struct page_table *pml4, size_t index)
 	for (i = 0; i < nblocks; ++i) {
 		page = base + i;
 		list_init(&page->pp_node);
-		list_init(&page->swap_node);
 	}
 
+	base->pp_blocktype = MIGRATE_MOVABLE;
+
 	npages = index + nblocks;
 
 	return 0;
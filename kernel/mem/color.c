@@ -0,0 +1,183 @@
+#include <types.h>
+#include <list.h>
+#include <paging.h>
+#include <spinlock.h>
+#include <string.h>
+
+#include <x86-64/asm.h>
+
+#include <kernel/mem.h>
+
+#define DEBUG 0
+
+/* The CPUID leaf that describes the caches. */
+#define CPUID_CACHE_PARAMS 4
+
+/* The number of page colors, i.e. the number of consecutive pages that map to
+ * different sets of the L2 cache. Page coloring is disabled if this is one.
+ */
+size_t page_colors = 1;
+
+/* The lists of free pages per color. */
+static struct list color_lists[PAGE_COLORS_MAX];
+static size_t ncolor_pages[PAGE_COLORS_MAX];
+
+#ifndef USE_BIG_KERNEL_LOCK
+/* Lock for the lists of free pages per color. */
+struct spinlock color_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "color_lock",
+#endif
+};
+#endif
+
+static void lock_color(void)
+{
+#ifndef USE_BIG_KERNEL_LOCK
+	spin_lock(&color_lock);
+#endif
+}
+
+static void unlock_color(void)
+{
+#ifndef USE_BIG_KERNEL_LOCK
+	spin_unlock(&color_lock);
+#endif
+}
+
+/* Determines the number of page colors from the size and associativity of the
+ * L2 cache as reported by CPUID. Page coloring stays disabled if the CPU does
+ * not report its cache parameters.
+ */
+void page_color_init(void)
+{
+	uint32_t eax, ebx, ecx, max_leaf;
+	size_t i, type, level, sets, line_size, partitions, colors;
+
+	for (i = 0; i < PAGE_COLORS_MAX; ++i) {
+		list_init(color_lists + i);
+	}
+
+	cpuid(0, &max_leaf, NULL, NULL, NULL);
+
+	if (max_leaf < CPUID_CACHE_PARAMS) {
+		return;
+	}
+
+	for (i = 0; ; ++i) {
+		cpuid_count(CPUID_CACHE_PARAMS, i, &eax, &ebx, &ecx, NULL);
+		type = eax & 0x1f;
+		level = (eax >> 5) & 0x7;
+
+		// There are no more caches
+		if (type == 0) {
+			return;
+		}
+
+		// Look for the L2 data or unified cache
+		if (level == 2 && type != 2) {
+			break;
+		}
+	}
+
+	line_size = (ebx & 0xfff) + 1;
+	partitions = ((ebx >> 12) & 0x3ff) + 1;
+	sets = ecx + 1;
+
+	// The bits of the set index above the page offset select the color
+	colors = sets * line_size * partitions / PAGE_SIZE;
+
+	if (colors < 2) {
+		return;
+	}
+
+	// Round down to a power of two
+	colors = 1ull << (63 - __builtin_clzll(colors));
+	page_colors = MIN(colors, PAGE_COLORS_MAX);
+
+	if (DEBUG) {
+		cprintf("[page_color_init]: %u page colors\n", page_colors);
+	}
+}
+
+/* Returns the color of the given page. */
+size_t page_color(struct page_info *page)
+{
+	return PAGE_INDEX(page2pa(page)) & (page_colors - 1);
+}
+
+/* Splits a free chunk that contains one page of every color into pages and
+ * puts them on the lists of their colors. The caller must hold the color lock.
+ */
+static void page_color_refill(int alloc_flags)
+{
+	struct page_info *page, *chunk;
+	size_t i, color, order = __builtin_ctzll(page_colors);
+
+	chunk = page_alloc_order(order, alloc_flags & ALLOC_MOVABLE);
+
+	if (!chunk) {
+		return;
+	}
+
+	for (i = 0; i < page_colors; ++i) {
+		page = chunk + i;
+		page->pp_order = 0;
+		page->pp_free = 0;
+		page->pp_zero = 0;
+		color = page_color(page);
+
+		// Return the page if there are enough of this color already
+		if (ncolor_pages[color] >= PAGE_COLOR_HIGH) {
+			list_init(&page->pp_node);
+			page_free(page);
+			continue;
+		}
+
+		list_add(color_lists + color, &page->pp_node);
+		++ncolor_pages[color];
+	}
+}
+
+/* Allocates a page of the given color, such that the pages of a VMA can be
+ * spread across the sets of the cache. Falls back to a page of any color if
+ * page coloring is disabled or if there is no free page of the color.
+ */
+struct page_info *page_alloc_color(size_t color, int alloc_flags)
+{
+	struct page_info *page;
+	struct list *node;
+
+	if (page_colors <= 1) {
+		return page_alloc(alloc_flags);
+	}
+
+	color &= page_colors - 1;
+
+	lock_color();
+
+	if (list_is_empty(color_lists + color)) {
+		page_color_refill(alloc_flags);
+	}
+
+	node = list_pop(color_lists + color);
+
+	if (node) {
+		--ncolor_pages[color];
+	}
+
+	unlock_color();
+
+	if (!node) {
+		return page_alloc(alloc_flags);
+	}
+
+	page = container_of(node, struct page_info, pp_node);
+	list_init(&page->pp_node);
+
+	if (alloc_flags & ALLOC_ZERO) {
+		memset(page2kva(page), 0, PAGE_SIZE);
+	}
+
+	return page;
+}
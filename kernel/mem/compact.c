@@ -0,0 +1,354 @@
+#include <types.h>
+#include <cpu.h>
+#include <list.h>
+#include <paging.h>
+#include <string.h>
+
+#include <x86-64/asm.h>
+
+#include <kernel/mem.h>
+#include <kernel/dev/rmap.h>
+#include <kernel/dev/swap.h>
+#include <kernel/sched.h>
+#include <kernel/sched/kernel_thread.h>
+
+#define DEBUG 0
+
+/* The number of pages in a 2M block. */
+#define COMPACT_BLOCK_PAGES (1 << BUDDY_2M_PAGE)
+
+extern struct swap_info swap;
+
+/* A PTE bit that is ignored by the CPU, used to remember that the PTE was
+ * writable while the page it maps is being migrated.
+ */
+#define PAGE_MIGRATE_WRITE (1 << 9)
+
+/* The block at which the next compaction run starts. */
+static size_t compact_cursor;
+
+struct compact_info {
+	struct page_info *old, *new;
+};
+
+/* Write-protects a PTE that maps the old page, such that the page cannot be
+ * modified while it is being copied.
+ */
+static int compact_protect_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct compact_info *info = walker->udata;
+
+	if ((*entry & PAGE_PRESENT) && PAGE_ADDR(*entry) == page2pa(info->old) &&
+	    (*entry & PAGE_WRITE)) {
+		*entry = (*entry & ~PAGE_WRITE) | PAGE_MIGRATE_WRITE;
+	}
+
+	return 0;
+}
+
+/* Points a PTE that maps the old page to the new page, and makes it writable
+ * again if it was write-protected by compact_protect_pte().
+ */
+static int compact_update_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct compact_info *info = walker->udata;
+	uint64_t flags;
+
+	if ((*entry & PAGE_PRESENT) && PAGE_ADDR(*entry) == page2pa(info->old)) {
+		flags = *entry & PAGE_MASK;
+
+		if (flags & PAGE_MIGRATE_WRITE) {
+			flags = (flags & ~PAGE_MIGRATE_WRITE) | PAGE_WRITE;
+		}
+
+		*entry = flags | page2pa(info->new);
+	}
+
+	return 0;
+}
+
+/* Walks the PTEs that map the page through its rmap, pointing them to the new
+ * page using the given callback.
+ */
+static void compact_walk_page(struct page_info *page, struct page_info *new,
+    int (*callback)(physaddr_t *, uintptr_t, uintptr_t, struct page_walker *))
+{
+	struct compact_info info = {
+		.old = page,
+		.new = new,
+	};
+	struct page_walker walker = {
+		.pte_callback = callback,
+		.udata = &info,
+	};
+
+	if (page->rmap) {
+		rmap_walk(page, &walker);
+	}
+}
+
+/* Checks whether the page is a user page that can be moved elsewhere, i.e. it
+ * is mapped through an rmap and on the page replacement list. Kernel pages,
+ * pages held by the page caches and pages that are being swapped out have no
+ * rmap or are not on the list. The caller must hold the swap lock.
+ */
+static int compact_movable(struct page_info *page)
+{
+	return !page->pp_free && page->pp_order == 0 && page->pp_ref > 0 &&
+	       page->rmap && !list_is_empty(&page->swap_node);
+}
+
+/* Copies the user page to a newly allocated page and rewrites all the PTEs
+ * that map the page through the rmap. The page must have been write-protected
+ * using compact_protect_pte() and the TLBs of all CPUs must have been flushed
+ * since, such that nobody writes to the page while it is being copied. The new
+ * page takes over the reference count, the rmap and the position on the page
+ * replacement list of the old page. The old page ends up unused, but is not
+ * freed. The caller must hold the swap lock.
+ *
+ * Returns 0 on success and -1 if out of memory.
+ */
+static int compact_migrate_page(struct page_info *page)
+{
+	struct page_info *new;
+
+	new = page_alloc(ALLOC_MOVABLE);
+
+	if (!new) {
+		return -1;
+	}
+
+	memcpy(page2kva(new), page2kva(page), PAGE_SIZE);
+	compact_walk_page(page, new, compact_update_pte);
+
+	new->pp_ref = page->pp_ref;
+	new->rmap = page->rmap;
+	list_insert_after(&page->swap_node, &new->swap_node);
+	list_del(&page->swap_node);
+
+	page->pp_ref = 0;
+	page->rmap = NULL;
+
+	return 0;
+}
+
+/* Returns the isolated chunks and pages of the block to the buddy allocator.
+ * The caller must hold the buddy lock.
+ */
+static void compact_putback(struct page_info *base, uint64_t *isolated)
+{
+	size_t i = 0;
+
+	while (i < COMPACT_BLOCK_PAGES) {
+		if (!(isolated[i / 64] & (1ull << (i % 64)))) {
+			++i;
+			continue;
+		}
+
+		buddy_free_page(base + i);
+		i += 1 << base[i].pp_order;
+	}
+}
+
+/* Marks the pages [i, i + n) of the block as isolated. */
+static void compact_mark(uint64_t *isolated, size_t i, size_t n)
+{
+	for (; n--; ++i) {
+		isolated[i / 64] |= 1ull << (i % 64);
+	}
+}
+
+/* Tries to free up the 2M block starting at page index index by isolating the
+ * free chunks in the block and by migrating the user pages in the block
+ * elsewhere. Gives up as soon as it finds a page that cannot be moved, in which
+ * case everything that has been isolated so far is returned to the buddy
+ * allocator.
+ *
+ * Returns 1 if the block has been returned to the buddy allocator as a single
+ * free 2M block, 0 otherwise.
+ */
+int compact_block(size_t index)
+{
+	struct page_info *base = pages + index, *page;
+	uint64_t isolated[COMPACT_BLOCK_PAGES / 64] = { 0 };
+	uint64_t rflags;
+	size_t i;
+	int ret = 0;
+
+	assert(index % COMPACT_BLOCK_PAGES == 0);
+
+	if (index + COMPACT_BLOCK_PAGES > npages) {
+		return 0;
+	}
+
+	// Don't get preempted while holding the locks
+	rflags = irq_save();
+
+	// Make sure our own page cache does not hold on to pages of the block
+	page_cache_drain();
+
+	if (!spin_trylock(&swap.lock)) {
+		irq_restore(rflags);
+		return 0;
+	}
+
+	lock_buddy();
+
+	// Nothing to do if the block is already free
+	if (base->pp_free && base->pp_order == BUDDY_2M_PAGE) {
+		goto out_unlock_buddy;
+	}
+
+	// Claim the free chunks and check that everything else can be moved
+	for (i = 0; i < COMPACT_BLOCK_PAGES; ) {
+		page = base + i;
+
+		// The block must not span multiple nodes
+		if (page->pp_nid != base->pp_nid) {
+			goto out_putback;
+		}
+
+		if (page->pp_free) {
+			buddy_isolate(page);
+			compact_mark(isolated, i, 1 << page->pp_order);
+			i += 1 << page->pp_order;
+			continue;
+		}
+
+		if (!compact_movable(page)) {
+			goto out_putback;
+		}
+
+		++i;
+	}
+
+	unlock_buddy();
+
+	// Write-protect the user pages of the block on every CPU before copying
+	for (i = 0; i < COMPACT_BLOCK_PAGES; ++i) {
+		if (!(isolated[i / 64] & (1ull << (i % 64)))) {
+			compact_walk_page(base + i, base + i, compact_protect_pte);
+		}
+	}
+
+	tlb_flush_user();
+
+	// Move the user pages out of the block
+	for (i = 0; i < COMPACT_BLOCK_PAGES; ++i) {
+		if (isolated[i / 64] & (1ull << (i % 64))) {
+			continue;
+		}
+
+		page = base + i;
+
+		if (ret < 0 || !compact_movable(page) ||
+		    compact_migrate_page(page) < 0) {
+			// Make the pages that stay in the block writable again
+			compact_walk_page(page, page, compact_update_pte);
+			ret = -1;
+			continue;
+		}
+
+		compact_mark(isolated, i, 1);
+	}
+
+	// Drop the TLB entries that point into the block before handing it out
+	tlb_flush_user();
+
+	if (ret < 0) {
+		ret = 0;
+		lock_buddy();
+		goto out_putback;
+	}
+
+	// Hand the block back as a single free 2M block
+	for (i = 0; i < COMPACT_BLOCK_PAGES; ++i) {
+		base[i].pp_free = 0;
+	}
+
+	base->pp_order = BUDDY_2M_PAGE;
+
+	lock_buddy();
+	buddy_free_page(base);
+	ret = 1;
+
+	debug_print("(CPU %d) Compacted block %p\n", this_cpu->cpu_id,
+		page2pa(base));
+
+	goto out_unlock_buddy;
+
+out_putback:
+	compact_putback(base, isolated);
+
+out_unlock_buddy:
+	unlock_buddy();
+	spin_unlock(&swap.lock);
+	irq_restore(rflags);
+
+	return ret;
+}
+
+/* Tries to compact up to nblocks 2M blocks, continuing where the previous run
+ * left off, until one of them has been freed up.
+ *
+ * Returns 1 if a free 2M block has been made available, 0 otherwise.
+ */
+int compact_memory(size_t nblocks)
+{
+	size_t index, total = npages / COMPACT_BLOCK_PAGES;
+
+	// The page structs are only known to be mapped once paging is set up
+	if (!kernel_pml4 || !total) {
+		return 0;
+	}
+
+	while (nblocks--) {
+		index = (compact_cursor++ % total) * COMPACT_BLOCK_PAGES;
+
+		// Skip holes in the physical memory map
+		if (!page_lookup(kernel_pml4, pages + index, NULL) ||
+		    !page_lookup(kernel_pml4, pages + index +
+		                 COMPACT_BLOCK_PAGES - 1, NULL)) {
+			continue;
+		}
+
+		// Blocks of unmovable pages are unlikely to be freed up
+		if (pages[index].pp_blocktype != MIGRATE_MOVABLE) {
+			continue;
+		}
+
+		if (compact_block(index)) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void yield_compact(void)
+{
+	cur_task->task_frame.rip = (uint64_t) &compact_thread;
+	cur_task->task_frame.rsp = KERNEL_STACK_TOP;
+	sched_yield();
+}
+
+/* Kernel thread that compacts memory in the background whenever free 2M blocks
+ * run low, such that huge page allocations keep succeeding.
+ */
+void compact_thread(void)
+{
+	size_t i;
+
+	for (i = 0; i < COMPACT_BATCH; ++i) {
+		if (count_free_pages(BUDDY_2M_PAGE) >= COMPACT_HUGE_LOW ||
+		    count_total_free_pages() <= COMPACT_MIN_FREE) {
+			break;
+		}
+
+		compact_memory(1);
+	}
+
+	yield_compact();
+}
@@ -4,6 +4,8 @@
 #include <paging.h>
 #include <cpu.h>
 
+#include <atomic.h>
+
 #include <x86-64/asm.h>
 
 #include <kernel/mem.h>
@@ -11,17 +13,32 @@
 
 #define DEBUG 0
 
-extern struct list buddy_free_list[];
+/* Memory above this address is not handed to the buddy allocator at boot, but
+ * by all CPUs in parallel once they have been started.
+ */
+#define PAGE_INIT_EAGER_LIM (128 * 1024 * 1024)
+#define PAGE_INIT_MAX_RANGES 32
 
 /* The kernel's initial PML4. */
 struct page_table *kernel_pml4;
 
+/* The ranges of free memory of which the initialization has been deferred,
+ * and the index of the next 2M section in [deferred_base, deferred_end) to
+ * initialize.
+ */
+static struct page_range {
+	uintptr_t start, end;
+} deferred_ranges[PAGE_INIT_MAX_RANGES];
+static size_t ndeferred_ranges;
+static uintptr_t deferred_base, deferred_end;
+static size_t deferred_next;
+
 /* This function sets up the initial PML4 for the kernel. */
 int pml4_setup(struct boot_info *boot_info)
 {
 	struct page_info *page;
 
-	uint64_t flags = (PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC);
+	uint64_t flags = (PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC | PAGE_GLOBAL);
 
 	/* Allocate the kernel PML4. */
 	page = page_alloc(ALLOC_ZERO);
@@ -89,9 +106,7 @@ void mem_init(struct boot_info *boot_info)
 	align_boot_info(boot_info);
 
 	/* Set up the buddy free lists. */
-	for (i = 0; i < BUDDY_MAX_ORDER; ++i) {
-		list_init(buddy_free_list + i);
-	};
+	buddy_init();
 
 	/* Find the amount of pages to allocate structs for. */
 	entry = (struct mmap_entry *)((physaddr_t)boot_info->mmap_addr);
@@ -111,6 +126,7 @@ void mem_init(struct boot_info *boot_info)
 	 * physical page, there is a corresponding struct page_info in this array.
 	 * 'npages' is the number of physical pages in memory.  Your code goes here.
 	 */
+	static_assert(sizeof(struct page_info) == PAGE_INFO_SIZE);
 	pages = boot_alloc(npages * sizeof *pages);
 
 	page_init(boot_info);
@@ -132,6 +148,11 @@ void mem_init(struct boot_info *boot_info)
 	/* Load the kernel PML4. */
 	load_pml4((struct page_table *)PADDR(kernel_pml4));
 
+	/* Keep the global kernel mappings in the TLB across CR3 reloads and
+	 * tag the TLB entries with PCIDs if supported.
+	 */
+	tlb_init();
+
 	/* Check the paging functions. */
 	lab2_check_paging();
 
@@ -140,6 +161,12 @@ void mem_init(struct boot_info *boot_info)
 
 	/* Check the buddy allocator. */
 	lab2_check_buddy(boot_info);
+
+	/* Set up the page cache of the boot CPU. */
+	page_cache_init();
+
+	/* Find the number of page colors. */
+	page_color_init();
 }
 
 void mem_init_mp(void)
@@ -151,7 +178,7 @@ void mem_init_mp(void)
 	struct cpuinfo *cpu = cpus;
 	int i;
 	uint64_t kernel_va;
-	uint64_t flags = (PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC);
+	uint64_t flags = (PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC | PAGE_GLOBAL);
 	for(i = 1; i < ncpus; i++){
 		cpu += i;
 		if(cpu == boot_cpu)
@@ -193,11 +220,15 @@ void page_init(struct boot_info *boot_info)
         page = pages + i;
 
         list_init(&page->pp_node);
-        list_init(&page->swap_node);
 
         page->pp_ref = 0;
         page->pp_free = 0;
         page->pp_order = 0;
+        page->pp_zero = 0;
+        page->pp_nid = 0;
+        page->rmap = NULL;
+        page->pp_blocktype = MIGRATE_MOVABLE;
+        page->pp_kmalloc = 0;
 	}
 
 	entry = (struct mmap_entry *)KADDR(boot_info->mmap_addr);
@@ -242,64 +273,145 @@ void page_init(struct boot_info *boot_info)
 	}
 }
 
+/* Maps and initializes the page descriptors for the physical page at pa and
+ * maps the following 2M of physical memory, if this has not been done yet.
+ */
+static void page_map_ext(uintptr_t pa)
+{
+	uint64_t flags = (PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC | PAGE_GLOBAL);
+	size_t index = PAGE_INDEX(pa);
+
+	if (index < npages) {
+		return;
+	}
+
+	// We have run out of page_info structs, so create new ones
+	if (buddy_map_chunk(kernel_pml4, index) < 0)
+		panic("No pages remaining");
+
+	// Map the 512 new pages starting from KERNEL_VMA where we did the previous mapping
+	boot_map_region(kernel_pml4, (void *)KERNEL_VMA + pa, 512 * PAGE_SIZE, pa, flags);
+
+	if (DEBUG) {
+		cprintf("mapping: va = [%p, %p] to pa = [%p, %p]\n",
+			(KERNEL_VMA + pa), (KERNEL_VMA + pa) + 512 * PAGE_SIZE,
+			pa, pa + 512 * PAGE_SIZE);
+	}
+}
+
 /* Extend the buddy allocator by initializing the page structure and memory
  * free list for the remaining available memory.
+ *
+ * Only the memory below PAGE_INIT_EAGER_LIM is handed to the buddy allocator
+ * right away. For the memory above, only the page descriptors and the direct
+ * map are set up, such that npages covers all of memory before the other CPUs
+ * start. Freeing the pages is deferred to page_init_deferred().
  */
 void page_init_ext(struct boot_info *boot_info)
 {
-	struct page_info *page;
+	struct page_range *range;
 	struct mmap_entry *entry;
-	uintptr_t pa, end;
+	uintptr_t p_start, p_end, pa;
 	size_t i;
-	int ret;
 
 	entry = (struct mmap_entry *)KADDR(boot_info->mmap_addr);
-	end = PADDR(boot_alloc(0));
 
 	/* Go through the entries in the memory map:
 	 *  1) Ignore the entry if the region is not free memory.
 	 *  2) Iterate through the pages in the region.
 	 *  3) If the physical address is below BOOT_MAP_LIM, ignore.
-	 *  4) Hand the page to the buddy allocator by calling page_free().
+	 *  4) Hand the page to the buddy allocator by calling page_free(), or
+	 *     defer this if the page is above PAGE_INIT_EAGER_LIM.
 	 */
+	for (i = 0; i < boot_info->mmap_len; ++i, ++entry) {
+		if (entry->type != MMAP_FREE)
+			continue;
 
+		p_start = MAX(entry->addr, BOOT_MAP_LIM);
+		p_end = entry->addr + entry->len;
 
-	uint64_t flags = (PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC);
-	uintptr_t index;
-	for (i = 0; i < boot_info->mmap_len; ++i, ++entry) {
-		if(entry->type == MMAP_FREE){
-			uint64_t p_start = entry->addr;
-			uint64_t p_end = p_start + entry->len;
+		if (p_start >= p_end)
+			continue;
 
-			for(uintptr_t j = p_start; j < p_end; j+= PAGE_SIZE){
-				if (0) {
-					cprintf("mapping: va = [%p, %p] -- BOOT_MAP_LIM: %p\n", 
-						(KERNEL_VMA + j), (KERNEL_VMA + j) + 512 * PAGE_SIZE,
-						KERNEL_VMA + BOOT_MAP_LIM);
-				}
-                if(j < BOOT_MAP_LIM) 
-					continue;
-				index = PAGE_INDEX(j);
-				page = pages + index;
-
-				if(index >= npages) {
-					// We have run out of page_info structs, so create new ones
-					if(buddy_map_chunk(kernel_pml4, index) < 0)
-						panic("No pages remaining");
-
-					// Map the 512 new pages starting from KERNEL_VMA where we did the previous mapping
-					boot_map_region(kernel_pml4, (void *)KERNEL_VMA + j, 512 * PAGE_SIZE, j ,flags);
-					if (1) {
-						cprintf("mapping: va = [%p, %p] to pa = [%p, %p]\n", 
-							(KERNEL_VMA + j), (KERNEL_VMA + j) + 512 * PAGE_SIZE, 
-							j, j + 512 * PAGE_SIZE);
-					} else {
-						cprintf("\tto pa = [%p, %p]\n", 
-							j, j + 512 * PAGE_SIZE);
-					}
-				}
-				page_free(page);
-            }
+		// Map the whole range up front, such that the direct map can
+		// use 1G pages, rather than one 2M section at a time.
+		boot_map_region(kernel_pml4, (void *)KERNEL_VMA + p_start,
+			p_end - p_start, p_start, PAGE_PRESENT | PAGE_WRITE |
+			PAGE_NO_EXEC | PAGE_GLOBAL);
+
+		// Free the pages that we need to boot right away
+		for (pa = p_start; pa < MIN(p_end, PAGE_INIT_EAGER_LIM);
+		     pa += PAGE_SIZE) {
+			page_map_ext(pa);
+			page_free(pa2page(pa));
+		}
+
+		p_start = MAX(p_start, PAGE_INIT_EAGER_LIM);
+
+		if (p_start >= p_end)
+			continue;
+
+		// Free the pages right away if we cannot track the range
+		if (ndeferred_ranges == PAGE_INIT_MAX_RANGES) {
+			for (pa = p_start; pa < p_end; pa += PAGE_SIZE) {
+				page_map_ext(pa);
+				page_free(pa2page(pa));
+			}
+
+			continue;
+		}
+
+		// Only set up the page descriptors, one 2M section at a time
+		for (pa = p_start; pa < p_end;
+		     pa = MAX(pa + PAGE_SIZE, npages * PAGE_SIZE)) {
+			page_map_ext(pa);
 		}
+
+		range = deferred_ranges + ndeferred_ranges++;
+		range->start = p_start;
+		range->end = p_end;
+
+		if (!deferred_base || p_start < deferred_base)
+			deferred_base = ROUNDDOWN(p_start, HPAGE_SIZE);
+
+		deferred_end = MAX(deferred_end, ROUNDUP(p_end, HPAGE_SIZE));
+	}
+}
+
+/* Hands the memory of which the initialization was deferred by
+ * page_init_ext() to the buddy allocator. Every CPU calls this once it has
+ * started, and the CPUs claim the 2M sections to free one at a time. The page
+ * descriptors of a section are set up and split into chunks without holding
+ * the buddy lock, such that this work is spread across all CPUs, and only
+ * the resulting chunks are added to the free lists under the lock. Returns
+ * once there are no sections left to claim.
+ */
+void page_init_deferred(void)
+{
+	struct page_range *range;
+	struct list chunks;
+	uintptr_t base, end, start, stop;
+	size_t i, nsections;
+
+	nsections = (deferred_end - deferred_base) / HPAGE_SIZE;
+
+	while ((i = atomic_inc(&deferred_next)) < nsections) {
+		list_init(&chunks);
+		base = deferred_base + i * HPAGE_SIZE;
+		end = base + HPAGE_SIZE;
+
+		for (range = deferred_ranges;
+		     range < deferred_ranges + ndeferred_ranges; ++range) {
+			start = MAX(range->start, base);
+			stop = MIN(range->end, end);
+
+			if (start >= stop)
+				continue;
+
+			buddy_prepare_range(pa2page(start),
+				(stop - start) / PAGE_SIZE, &chunks);
+		}
+
+		buddy_free_chunks(&chunks);
 	}
 }
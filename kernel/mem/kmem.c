@@ -1,9 +1,21 @@
 #include <types.h>
 #include <cpu.h>
+#include <string.h>
+#include <stdio.h>
+#include <lib.h>
+
+#include <x86-64/asm.h>
 
 #include <kernel/acpi.h>
 #include <kernel/mem.h>
 
+/* The slab allocators for kmalloc(), shared by all CPUs, followed by the
+ * caches created by kmem_cache_create().
+ */
+struct slab slabs[KMEM_MAX_CACHES];
+size_t nslabs;
+static size_t ncaches;
+
 /* Sets up slab allocators for every multiple of SLAB_ALIGN bytes starting from
  * SLAB_ALIGN.
  */
@@ -18,25 +30,73 @@ int kmem_init(void)
 	for (i = 0; i < nslabs; ++i) {
 		slab = slabs + i;
 		obj_size = (i + 1) * SLAB_ALIGN;
-		slab_setup(slab, obj_size);
+		slab_setup(slab, obj_size, SLAB_ALIGN);
+		slab->id = i;
 	}
 
+	ncaches = nslabs;
+
 	return 0;
 }
 
+/* The slab allocators are shared, and the magazines of the other CPUs start
+ * out empty, so there is nothing left to set up.
+ */
 int kmem_init_mp(void)
 {
 	/* LAB 6: your code here. */
-	return kmem_init();
+	return 0;
+}
+
+/* Allocates a chunk of memory that is too large for the slab allocators
+ * directly from the buddy allocator, as the smallest power of two number of
+ * pages that fits the size. The first page is tagged, such that kfree() can
+ * tell it apart from slab objects.
+ */
+static void *kmalloc_large(size_t size)
+{
+	struct page_info *page;
+	size_t order = 0;
+
+	while ((PAGE_SIZE << order) < size) {
+		++order;
+	}
+
+	if (order >= BUDDY_MAX_ORDER) {
+		return NULL;
+	}
+
+	page = page_alloc_order(order, 0);
+
+	if (!page) {
+		return NULL;
+	}
+
+	++page->pp_ref;
+	page->pp_kmalloc = 1;
+
+	return page2kva(page);
+}
+
+/* Frees a chunk of memory allocated by kmalloc_large(). */
+static void kfree_large(struct page_info *page)
+{
+	page->pp_kmalloc = 0;
+	--page->pp_ref;
+	page_free_order(page, page->pp_order);
 }
 
 /* Allocates a chunk of memory of size bytes.
  *
  * If the size is zero, this function returns NULL.
- * If the size is greater than or equal to the highest object size available in
- * the set of slab allocators, this function returns NULL.
+ * If the size is greater than the highest object size available in the set of
+ * slab allocators, this function allocates the memory as pages from the buddy
+ * allocator using kmalloc_large(), which fails for anything beyond the
+ * largest buddy order.
  * Otherwise this function finds the best fit slab allocator for the requested
- * size and uses slab_alloc() to allocate the chunk of memory. */
+ * size and uses slab_cache_alloc() to allocate the chunk of memory from the
+ * magazine of this CPU.
+ * The memory is not cleared, use kzalloc() for that. */
 void *kmalloc(size_t size)
 {
 	size_t index;
@@ -48,14 +108,171 @@ void *kmalloc(size_t size)
 	size = ROUNDUP(size, SLAB_ALIGN);
 	index = (size / SLAB_ALIGN) - 1;
 	if (index >= nslabs) {
-		return NULL;
+		return kmalloc_large(size);
 	}
 
-	return slab_alloc(slabs + index);
+	return slab_cache_alloc(slabs + index);
 }
 
-/* This function calls slab_free() to free the chunk of memory. */
+/* Allocates a chunk of memory of size bytes using kmalloc() and clears it. */
+void *kzalloc(size_t size)
+{
+	void *p = kmalloc(size);
+
+	if (p) {
+		memset(p, 0, size);
+	}
+
+	return p;
+}
+
+/* This function frees the chunk of memory. Large allocations are recognized
+ * by the tag on their first page and returned to the buddy allocator, and
+ * anything else is freed with slab_cache_free().
+ */
 void kfree(void *p)
 {
-	slab_free(p);
+	struct page_info *page;
+
+	if ((uintptr_t)p % PAGE_SIZE == 0) {
+		page = pa2page(PADDR(p));
+
+		if (page->pp_kmalloc) {
+			kfree_large(page);
+			return;
+		}
+	}
+
+	slab_cache_free(p);
+}
+
+/* Creates a cache for objects of the given size and alignment. The
+ * constructor, if any, is called once for every object when the cache grows,
+ * rather than on every allocation. Objects are not cleared when they are
+ * freed, so objects in a cache with a constructor must be freed in their
+ * constructed state.
+ *
+ * Returns the cache on success. Otherwise this function returns NULL.
+ */
+struct slab *kmem_cache_create(const char *name, size_t size, size_t align,
+	void (*ctor)(void *))
+{
+	struct slab *cache;
+
+	if (size == 0 || ncaches >= KMEM_MAX_CACHES) {
+		return NULL;
+	}
+
+	cache = slabs + ncaches;
+	cache->ctor = ctor;
+	slab_setup(cache, size, align);
+
+	if (cache->count == 0) {
+		return NULL;
+	}
+
+	cache->name = name;
+	cache->id = ncaches++;
+
+	return cache;
+}
+
+/* Allocates an object from the given cache. */
+void *kmem_cache_alloc(struct slab *cache)
+{
+	return slab_cache_alloc(cache);
+}
+
+/* Frees an object that was allocated from the given cache. */
+void kmem_cache_free(struct slab *cache, void *p)
+{
+	assert(slab_get_info(p)->slab == cache);
+
+	slab_cache_free(p);
+}
+
+/* Returns the empty slabs kept around by every slab allocator to the buddy
+ * allocator. This is called by reclaim when the system is low on memory.
+ *
+ * Returns the number of pages that have been freed.
+ */
+size_t kmem_shrink(void)
+{
+	size_t i, nfreed = 0;
+
+	for (i = 0; i < ncaches; ++i) {
+		nfreed += slab_shrink(slabs + i) << slabs[i].order;
+	}
+
+	return nfreed;
+}
+
+/* Fills in the statistics of the slab allocator with the given id. The
+ * counters of every CPU are summed up, and the objects in the magazines are
+ * not counted as active.
+ *
+ * Returns 0 on success, or -1 if there is no slab allocator with the id.
+ */
+int kmem_get_info(size_t id, struct slabinfo *info)
+{
+	struct slab *slab;
+	struct slab_info *slab_info;
+	struct kmem_stats *stats;
+	struct list *node;
+	uint64_t rflags;
+	size_t i, ncached = 0;
+
+	if (id >= ncaches) {
+		return -1;
+	}
+
+	slab = slabs + id;
+	memset(info, 0, sizeof *info);
+
+	if (slab->name) {
+		strlcpy(info->name, slab->name, sizeof info->name);
+	} else {
+		snprintf(info->name, sizeof info->name, "kmalloc-%u",
+			slab->obj_size);
+	}
+
+	info->obj_size = slab->obj_size;
+	info->objs_per_slab = slab->count;
+	info->pages_per_slab = 1 << slab->order;
+
+	rflags = irq_save();
+	spin_lock(&slab->lock);
+
+	list_foreach(&slab->partial, node) {
+		slab_info = container_of(node, struct slab_info, node);
+		info->active_objs += slab->count - slab_info->free_count;
+		++info->npartial;
+	}
+
+	list_foreach(&slab->full, node) {
+		++info->nfull;
+	}
+
+	info->active_objs += info->nfull * slab->count;
+	info->nempty = slab->nempty;
+
+	spin_unlock(&slab->lock);
+	irq_restore(rflags);
+
+	info->nslabs = info->npartial + info->nfull + info->nempty;
+	info->total_objs = info->nslabs * slab->count;
+
+	for (i = 0; i < ncpus; ++i) {
+		ncached += cpus[i].kmem.mags[id].count;
+		stats = cpus[i].kmem.stats + id;
+		info->nallocs += stats->nallocs;
+		info->nfrees += stats->nfrees;
+		info->nrefills += stats->nrefills;
+		info->nflushes += stats->nflushes;
+		info->nremote_frees += stats->nremote_frees;
+	}
+
+	info->active_objs -= MIN(ncached, info->active_objs);
+
+	return 0;
 }
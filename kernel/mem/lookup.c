@@ -11,6 +11,9 @@ static uintptr_t sign_extend(uintptr_t addr)
 
 struct lookup_info {
 	physaddr_t *entry;
+
+	/* The offset of the address into the huge page, if any. */
+	uintptr_t offset;
 };
 
 /* If the PTE points to a present page, store the pointer to the PTE into the
@@ -36,10 +39,44 @@ static int lookup_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
 	struct lookup_info *info = walker->udata;
 
 	/* LAB 2: your code here. */
+	if ((*entry & PAGE_PRESENT) && (*entry & PAGE_HUGE)) {
+		info->entry = entry;
+		info->offset = base & (HPAGE_SIZE - 1);
+	}
+
+	return 0;
+}
+
+/* If the PDPTE points to a present 1G page, store the pointer to the PDPTE into
+ * the info struct of the walker. */
+static int lookup_pdpte(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct lookup_info *info = walker->udata;
+
+	if ((*entry & PAGE_PRESENT) && (*entry & PAGE_HUGE)) {
+		info->entry = entry;
+		info->offset = base & (PAGE_DIR_SPAN - 1);
+	}
+
 	return 0;
 }
 
-/* Return the page mapped at virtual address 'va'.
+/* Stores the pointer to the PDE into the info struct of the walker, whether
+ * the PDE is present or not.
+ */
+static int lookup_pde_entry(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct lookup_info *info = walker->udata;
+
+	info->entry = entry;
+
+	return 0;
+}
+
+/* Return the page mapped at virtual address 'va'. For huge pages, this is the
+ * 4K page within the 2M or 1G page that 'va' points into.
  * If entry_store is not zero, then we store the address of the PTE for this
  * page into entry_store.
  * This is function can be used to verify page permissions for system call
@@ -56,11 +93,13 @@ struct page_info *page_lookup(struct page_table *pml4, void *va,
 
 	struct lookup_info info = {
 		.entry = NULL,
+		.offset = 0,
 	};
 
 	struct page_walker walker = {
 		.pte_callback = lookup_pte,
 		.pde_callback = lookup_pde,
+		.pdpte_callback = lookup_pdpte,
 		.udata = &info,
 	};
 
@@ -74,18 +113,32 @@ struct page_info *page_lookup(struct page_table *pml4, void *va,
 	if (!info.entry)
 		return NULL;
 
-	if (!entry_store || !*entry_store) {
-		pa = sign_extend(PAGE_ADDR(*info.entry));
-		if (pa >= KERNEL_VMA) 
-			pa = PADDR((void *)pa);
-        return pa2page(pa);
-	}
+	if (entry_store)
+		*entry_store = info.entry;
 
-	if (*entry_store && info.entry) {
-        *entry_store = info.entry;
-		pa = sign_extend(PAGE_ADDR(**entry_store));
-        return pa2page(pa);
-    }
+	pa = sign_extend(PAGE_ADDR(*info.entry));
+	if (pa >= KERNEL_VMA) 
+		pa = PADDR((void *)pa);
+
+	return pa2page(pa + info.offset);
+}
+
+/* Returns a pointer to the PDE that covers the virtual address 'va', whether
+ * it is present or not, or NULL if there is no page directory for 'va'.
+ */
+physaddr_t *pde_lookup(struct page_table *pml4, void *va)
+{
+	struct lookup_info info = {
+		.entry = NULL,
+	};
+	struct page_walker walker = {
+		.pde_callback = lookup_pde_entry,
+		.udata = &info,
+	};
+
+	if (walk_page_range(pml4, va, (void *)((uintptr_t)va + PAGE_SIZE),
+	    &walker) < 0)
+		return NULL;
 
-	return NULL;
+	return info.entry;
 }
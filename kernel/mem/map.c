@@ -8,6 +8,13 @@
 
 #define DEBUG 0
 
+/* The CPUID leaves that report the extended processor features. */
+#define CPUID_EXT_BASE     0x80000000
+#define CPUID_EXT_FEATURES 0x80000001
+
+/* The bit in EDX of the extended features that reports 1G page support. */
+#define CPUID_EXT_PDPE1GB  (1 << 26)
+
 struct boot_map_info {
 	struct page_table *pml4;
 	uint64_t flags;
@@ -15,49 +22,183 @@ struct boot_map_info {
 	uintptr_t base, end;
 };
 
-/* Stores the physical address and the appropriate permissions into the PTE and
- * increments the physical address to point to the next page.
+/* Returns whether the CPU supports 1G pages. */
+static int boot_map_has_1g(void)
+{
+	uint32_t max_leaf, edx;
+
+	cpuid(CPUID_EXT_BASE, &max_leaf, NULL, NULL, NULL);
+
+	if (max_leaf < CPUID_EXT_FEATURES) {
+		return 0;
+	}
+
+	cpuid(CPUID_EXT_FEATURES, NULL, NULL, NULL, &edx);
+
+	return !!(edx & CPUID_EXT_PDPE1GB);
+}
+
+/* Returns the physical address that the virtual address addr maps to. */
+static physaddr_t boot_map_pa(struct boot_map_info *info, uintptr_t addr)
+{
+	return info->pa + (addr - info->base);
+}
+
+/* Returns whether the range [base, end] passed to a callback spans the entire
+ * area of the given size at base, and whether both the virtual and the
+ * physical address are aligned to the size, such that the area can be mapped
+ * using a single large page. The end of the range may stop short of the last
+ * byte, so only the last page is checked.
  */
+static int boot_map_fits(struct boot_map_info *info, uintptr_t base,
+    uintptr_t end, size_t size)
+{
+	return !(base & (size - 1)) && !(boot_map_pa(info, base) & (size - 1)) &&
+	       end >= base + size - PAGE_SIZE;
+}
+
+/* Returns whether the large page of the given size at the entry already maps
+ * base to the requested physical address with the requested permissions.
+ */
+static int boot_map_matches(physaddr_t *entry, uintptr_t base, size_t size,
+    struct boot_map_info *info)
+{
+	physaddr_t pa = PAGE_ADDR(*entry) + (base & (size - 1));
+	uint64_t flags = (*entry & PAGE_MASK) & ~(PAGE_ACCESSED | PAGE_DIRTY);
+
+	return pa == boot_map_pa(info, base) &&
+	       flags == (info->flags | PAGE_PRESENT | PAGE_HUGE);
+}
+
+/* Stores the new value into the entry that maps the area of the given size at
+ * base. If the entry was already present, the old mapping is flushed from the
+ * TLBs of all CPUs. The kernel mappings are global, so reloading CR3 does not
+ * drop them.
+ */
+static void boot_map_set(physaddr_t *entry, physaddr_t val, uintptr_t base,
+    size_t size)
+{
+	physaddr_t old = *entry;
+
+	*entry = val;
+
+	if ((old & PAGE_PRESENT) && old != val) {
+		base = ROUNDDOWN(base, size);
+		tlb_flush_range(NULL, base, base + size);
+	}
+}
+
+/* Stores the physical address and the appropriate permissions into the PTE. */
 static int boot_map_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
 	struct boot_map_info *info = walker->udata;
-	
-	// Zero out the entire entry
-	*entry = 0;
-
-	// Set the new address of the PTE to the physical address of the page
-	*entry = info->pa;
 
-	// Set permissions
-	*entry |= info->flags;
+	boot_map_set(entry, boot_map_pa(info, base) | info->flags | PAGE_PRESENT,
+		base, PAGE_SIZE);
 
-	// Set status to mapped if not already done by the flags above
-	*entry |= PAGE_PRESENT;
-
-	//increment pa to point to next page
-	info->pa += PAGE_SIZE;
-	
 	return 0;
 }
 
-/* Stores the physical address and the appropriate permissions into the PDE and
- * increments the physical address to point to the next huge page if the
- * physical address is huge page aligned and if the area to be mapped covers a
- * 2M area. Otherwise this function calls ptbl_split() to split down the huge
- * page or allocate a page table.
+/* Stores the physical address and the appropriate permissions into the PDE
+ * as a 2M page if the area to be mapped covers the 2M area of the PDE and if
+ * the physical address is 2M aligned. A 2M page that already maps the area as
+ * requested is left alone. Otherwise this function calls ptbl_split() to split
+ * down the huge page or allocate a page table, which flushes the huge page
+ * from the TLBs.
  */
 static int boot_map_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
 	struct boot_map_info *info = walker->udata;
-	return ptbl_alloc(entry, base, end, walker);
+
+	if ((*entry & PAGE_PRESENT) && !(*entry & PAGE_HUGE)) {
+		return 0;
+	}
+
+	if (boot_map_fits(info, base, end, HPAGE_SIZE)) {
+		boot_map_set(entry, boot_map_pa(info, base) | info->flags |
+			PAGE_PRESENT | PAGE_HUGE, base, HPAGE_SIZE);
+		return 0;
+	}
+
+	if ((*entry & PAGE_PRESENT) &&
+	    boot_map_matches(entry, base, HPAGE_SIZE, info)) {
+		return 0;
+	}
+
+	return ptbl_split(entry, base, end, walker);
+}
+
+/* Splits up the 1G page at the PDPTE into 2M pages with the same permissions
+ * by allocating a page directory, and flushes the 1G page from the TLBs.
+ */
+static int boot_split_pdpte(physaddr_t *entry, uintptr_t base)
+{
+	struct page_info *page;
+	struct page_table *pdir;
+	physaddr_t pa;
+	uint64_t flags;
+	size_t i;
+
+	page = page_alloc(ALLOC_ZERO);
+
+	if (!page) {
+		return -1;
+	}
+
+	++page->pp_ref;
+	pdir = page2kva(page);
+
+	pa = PAGE_ADDR(*entry);
+	flags = *entry & PAGE_MASK;
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		pdir->entries[i] = (pa + i * HPAGE_SIZE) | flags;
+	}
+
+	boot_map_set(entry, page2pa(page) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER,
+		base, PAGE_DIR_SPAN);
+
+	return 0;
 }
 
+/* Stores the physical address and the appropriate permissions into the PDPTE
+ * as a 1G page if the CPU supports 1G pages, if the area to be mapped covers
+ * the 1G area of the PDPTE and if the physical address is 1G aligned. A 1G
+ * page that already maps the area as requested is left alone, but is split
+ * into 2M pages otherwise. If no 1G page is used, this function allocates a
+ * page directory.
+ */
 static int boot_map_pdpte(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
-	return ptbl_alloc(entry, base, end, walker);
+	struct boot_map_info *info = walker->udata;
+	static int has_1g = -1;
+
+	if ((*entry & PAGE_PRESENT) && !(*entry & PAGE_HUGE)) {
+		return 0;
+	}
+
+	if (has_1g < 0) {
+		has_1g = boot_map_has_1g();
+	}
+
+	if (has_1g && boot_map_fits(info, base, end, PAGE_DIR_SPAN)) {
+		boot_map_set(entry, boot_map_pa(info, base) | info->flags |
+			PAGE_PRESENT | PAGE_HUGE, base, PAGE_DIR_SPAN);
+		return 0;
+	}
+
+	if (!(*entry & PAGE_PRESENT)) {
+		return ptbl_alloc(entry, base, end, walker);
+	}
+
+	if (boot_map_matches(entry, base, PAGE_DIR_SPAN, info)) {
+		return 0;
+	}
+
+	return boot_split_pdpte(entry, base);
 }
 
 static int boot_map_pml4e(physaddr_t *entry, uintptr_t base, uintptr_t end,
@@ -72,14 +213,14 @@ static int boot_map_pml4e(physaddr_t *entry, uintptr_t base, uintptr_t end,
  * permissions of the page to set are passed through the flags argument.
  *
  * This function is only intended to set up static mappings. As such, it should
- * not change the reference counts of the mapped pages.
+ * not change the reference counts of the mapped pages. Areas that are suitably
+ * aligned are mapped using 1G and 2M pages to save TLB entries.
  *
  * Hint: this function calls walk_page_range().
  */
 void boot_map_region(struct page_table *pml4, void *va, size_t size,
     physaddr_t pa, uint64_t flags)
 {
-	/* LAB 2: your code here. */
 	struct boot_map_info info = {
 		.pa = pa,
 		.flags = flags,
@@ -101,6 +242,54 @@ void boot_map_region(struct page_table *pml4, void *va, size_t size,
 	walk_page_range(pml4, va, (void *)((uintptr_t)va + size), &walker);
 }
 
+/* Stores the physical address of the huge page and the permissions into the
+ * PDE, unless the PDE is already present.
+ */
+static int boot_map_huge_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct boot_map_info *info = walker->udata;
+
+	if (!(*entry & PAGE_PRESENT)) {
+		*entry = boot_map_pa(info, base) | info->flags | PAGE_PRESENT |
+		         PAGE_HUGE;
+	}
+
+	return 0;
+}
+
+/*
+ * Maps the virtual address space at [va, va + size) to the contiguous physical
+ * address space at [pa, pa + size) using 2M pages. The addresses and the size
+ * must be 2M aligned. PDEs that are already present are left alone.
+ *
+ * Like boot_map_region(), this does not change the reference counts of the
+ * mapped pages.
+ */
+void boot_map_huge_region(struct page_table *pml4, void *va, size_t size,
+    physaddr_t pa, uint64_t flags)
+{
+	struct boot_map_info info = {
+		.pa = pa,
+		.flags = flags,
+		.base = (uintptr_t)va,
+		.end = (uintptr_t)va + size - 1,
+		.pml4 = pml4,
+	};
+	struct page_walker walker = {
+		.pde_callback = boot_map_huge_pde,
+		.pdpte_callback = boot_map_pdpte,
+		.pml4e_callback = boot_map_pml4e,
+		.udata = &info,
+	};
+
+	assert(hpage_aligned((uintptr_t)va));
+	assert(hpage_aligned(pa));
+	assert(hpage_aligned(size));
+
+	walk_page_range(pml4, va, (void *)((uintptr_t)va + size), &walker);
+}
+
 /* Creates a mapping in the MMIO region to [pa, pa + size) for
  * memory-mapped I/O.
  */
@@ -175,10 +364,11 @@ uint64_t convert_flags_from_elf_to_pages(struct elf_proghdr *hdr)
  * to map the regions into the page table with the appropriate permissions.
  *
  * First creates an identity mapping at the KERNEL_VMA of size BOOT_MAP_LIM
- * with permissions RW-.
+ * with permissions RW-, using 2M pages.
  *
  * Then iterates the program headers to map the regions with the appropriate
- * permissions.
+ * permissions, which splits the 2M pages that they touch into 4K pages. All of
+ * these mappings are global, as they are shared by every address space.
  *
  * Hint: this function calls boot_map_region().
  * Hint: this function ignores program headers below KERNEL_VMA (e.g. ".boot").
@@ -197,7 +387,7 @@ void boot_map_kernel(struct page_table *pml4, struct elf *elf_hdr)
 	}
 
 	// Create identity mapping at KERNEL_VMA of size BOOT_MAP_LIM with RW-
-	flags = (PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC); 
+	flags = (PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC | PAGE_GLOBAL);
 
 	boot_map_region(pml4, (void *)KERNEL_VMA, BOOT_MAP_LIM, 0, flags);
 
@@ -213,7 +403,7 @@ void boot_map_kernel(struct page_table *pml4, struct elf *elf_hdr)
 		hdr = prog_hdr + i;
 		if((void *) (hdr)->p_va > (void *) KERNEL_VMA){
 			// Convert flags from ELF to pages
-			flags = convert_flags_from_elf_to_pages(hdr);
+			flags = convert_flags_from_elf_to_pages(hdr) | PAGE_GLOBAL;
 
 			// Map the ELF program headers from VA -> PA
 			boot_map_region(pml4, (void *) hdr->p_va, hdr->p_memsz, hdr->p_pa, flags);
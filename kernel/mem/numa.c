@@ -0,0 +1,206 @@
+#include <types.h>
+#include <cpu.h>
+#include <stdio.h>
+
+#include <kernel/acpi.h>
+#include <kernel/mem.h>
+
+/* The number of NUMA nodes. Without an SRAT all memory is on node 0. */
+size_t nnodes = 1;
+
+/* The SLIT distance between each pair of nodes. */
+uint8_t node_distance[MAX_NUMNODES][MAX_NUMNODES];
+
+/* For each node, the nodes to allocate memory from, ordered by distance. */
+uint8_t node_fallback[MAX_NUMNODES][MAX_NUMNODES];
+
+/* The proximity domain of each node found while parsing the SRAT. */
+static uint32_t node_domain[MAX_NUMNODES];
+static size_t nnodes_found;
+
+/* The ranges of physical memory and the node they belong to. */
+struct numa_range {
+	physaddr_t base, end;
+	int nid;
+};
+
+static struct numa_range numa_ranges[MAX_NUMA_RANGES];
+static size_t nranges;
+
+/* Looks up the node for the given proximity domain.
+ *
+ * Returns the node or -1 if the domain is unknown.
+ */
+static int domain2nid(uint32_t domain)
+{
+	size_t nid;
+
+	for (nid = 0; nid < nnodes_found; ++nid) {
+		if (node_domain[nid] == domain) {
+			return nid;
+		}
+	}
+
+	return -1;
+}
+
+/* Looks up the node for the given proximity domain, adding a new node if the
+ * domain has not been seen before.
+ *
+ * Returns the node or -1 if there are too many nodes.
+ */
+static int domain2nid_add(uint32_t domain)
+{
+	int nid = domain2nid(domain);
+
+	if (nid >= 0) {
+		return nid;
+	}
+
+	if (nnodes_found >= MAX_NUMNODES) {
+		cprintf("NUMA: too many nodes, ignoring domain %u\n", domain);
+		return -1;
+	}
+
+	node_domain[nnodes_found] = domain;
+
+	return nnodes_found++;
+}
+
+int numa_add_memory(uint32_t domain, physaddr_t base, size_t len)
+{
+	int nid = domain2nid_add(domain);
+
+	if (nid < 0) {
+		return -1;
+	}
+
+	if (nranges >= MAX_NUMA_RANGES) {
+		cprintf("NUMA: too many memory ranges, ignoring %p - %p\n",
+			base, base + len);
+		return -1;
+	}
+
+	numa_ranges[nranges].base = base;
+	numa_ranges[nranges].end = base + len;
+	numa_ranges[nranges].nid = nid;
+	++nranges;
+
+	return 0;
+}
+
+/* Assigns the CPU with the given APIC ID to the node of the proximity domain.
+ * The CPUs must have been enumerated from the MADT already.
+ */
+int numa_add_cpu(uint32_t domain, uint32_t apic_id)
+{
+	struct cpuinfo *cpu;
+	int nid = domain2nid_add(domain);
+
+	if (nid < 0) {
+		return -1;
+	}
+
+	for (cpu = cpus; cpu < cpus + ncpus; ++cpu) {
+		if (cpu->cpu_id == apic_id) {
+			cpu->cpu_nid = nid;
+		}
+	}
+
+	return 0;
+}
+
+void numa_set_distance(uint32_t from, uint32_t to, uint8_t distance)
+{
+	int from_nid = domain2nid(from);
+	int to_nid = domain2nid(to);
+
+	if (from_nid < 0 || to_nid < 0) {
+		return;
+	}
+
+	node_distance[from_nid][to_nid] = distance;
+}
+
+/* Gets the node that the physical address belongs to. Memory that is not
+ * covered by the SRAT is considered to be on node 0.
+ */
+int pa2nid(physaddr_t pa)
+{
+	size_t i;
+
+	for (i = 0; i < nranges; ++i) {
+		if (numa_ranges[i].base <= pa && pa < numa_ranges[i].end) {
+			return numa_ranges[i].nid;
+		}
+	}
+
+	return 0;
+}
+
+/* Orders the nodes to allocate from for each node by their distance, such that
+ * each node prefers its own memory and then the memory of the closest nodes.
+ */
+static void numa_build_fallback(void)
+{
+	size_t nid, i, j;
+	uint8_t *order, tmp;
+
+	for (nid = 0; nid < nnodes_found; ++nid) {
+		order = node_fallback[nid];
+
+		for (i = 0; i < nnodes_found; ++i) {
+			order[i] = i;
+		}
+
+		// Insertion sort, keeping the node order for equal distances
+		for (i = 1; i < nnodes_found; ++i) {
+			for (j = i; j > 0 && node_distance[nid][order[j - 1]] >
+			     node_distance[nid][order[j]]; --j) {
+				tmp = order[j];
+				order[j] = order[j - 1];
+				order[j - 1] = tmp;
+			}
+		}
+	}
+}
+
+/* Discovers the NUMA topology from the SRAT and the SLIT and moves the free
+ * memory into the buddy zone of the node it belongs to. Has to be called
+ * before the other CPUs are started.
+ */
+void numa_init(struct rsdp *rsdp)
+{
+	size_t i, j;
+
+	if (srat_init(rsdp) < 0 || nnodes_found <= 1) {
+		for (i = 0; i < NCPUS; ++i) {
+			cpus[i].cpu_nid = 0;
+		}
+
+		nnodes_found = 0;
+		nranges = 0;
+		return;
+	}
+
+	// Use the default distances, unless there is a SLIT
+	for (i = 0; i < nnodes_found; ++i) {
+		for (j = 0; j < nnodes_found; ++j) {
+			node_distance[i][j] = (i == j) ? NUMA_LOCAL_DISTANCE :
+				NUMA_REMOTE_DISTANCE;
+		}
+	}
+
+	slit_init(rsdp);
+	numa_build_fallback();
+
+	nnodes = nnodes_found;
+	buddy_init_zones();
+
+	cprintf("NUMA: %u nodes\n", nnodes);
+
+	for (i = 0; i < nranges; ++i) {
+		cprintf("NUMA: node %u: %p - %p\n", numa_ranges[i].nid,
+			numa_ranges[i].base, numa_ranges[i].end);
+	}
+}
@@ -12,35 +12,87 @@
 
 extern struct swap_info swap;
 
+/* The number of pages to allocate at once when populating a region. */
+#define POPULATE_BATCH 512
+
 struct populate_info {
 	uint64_t flags;
 	uintptr_t base, end;
+
+	/* Pages allocated in bulk that have not been mapped yet. */
+	struct list pages;
+
+	/* The VMA of the last user page that has been mapped. */
+	struct vma *vma;
+
+	/* Whether to map huge pages where the region covers a 2M area. */
+	int huge;
 };
 
+/* Returns the VMA of the user page at base, remembering it for the next page.
+ */
+static struct vma *populate_find_vma(struct populate_info *info,
+    uintptr_t base)
+{
+	struct vma *vma = info->vma;
+
+	assert(cur_task);
+
+	if (!vma || base < (uintptr_t)vma->vm_base ||
+	    base >= (uintptr_t)vma->vm_end) {
+		vma = task_find_vma(cur_task, (void *) base);
+		info->vma = vma;
+	}
+
+	if (!vma) {
+		panic("no vma\n");
+	}
+
+	return vma;
+}
+
 static int populate_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
 	struct page_info *page;
 	struct populate_info *info = walker->udata;
-	struct vma *vma;
+	struct vma *vma = info->vma;
+	struct list *node;
+	// User pages can be migrated through their rmap
+	int alloc_flags = ALLOC_ZERO |
+		((info->flags & PAGE_USER) ? ALLOC_MOVABLE : 0);
 
 	// Sanity check - there should be no present pages at the given va
 	assert(!(*entry & PAGE_PRESENT));
 
-	page = page_alloc(ALLOC_ZERO);
+	if (info->flags & PAGE_USER) {
+		vma = populate_find_vma(info, base);
+	}
+
+	if (vma && (vma->vm_flags & VM_COLOR)) {
+		// Spread the pages of the VMA across the page colors
+		page = page_alloc_color(PAGE_INDEX(base), alloc_flags);
+	} else {
+		// Allocate the pages for the rest of the region in batches
+		if (list_is_empty(&info->pages)) {
+			page_alloc_bulk(MIN(POPULATE_BATCH,
+				(info->end - base) / PAGE_SIZE + 1),
+				alloc_flags, &info->pages);
+		}
+
+		if ((node = list_pop_tail(&info->pages))) {
+			page = container_of(node, struct page_info, pp_node);
+		} else {
+			page = page_alloc(alloc_flags);
+		}
+	}
+
 	if (!page) {
 		return -1;
 	}
 
 	// Write the rmap of the VMA in the page struct
-	//if (cur_task) {
 	if (info->flags & PAGE_USER) {
-		assert(cur_task);
-		vma = task_find_vma(cur_task, (void *) base);
-		if (!vma) {
-			panic("no vma\n");
-			return -1;
-		}
 		page->rmap = vma->rmap;
 
 		spin_lock(&swap.lock);
@@ -67,42 +119,121 @@ static int populate_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
 	// Set status to mapped if not already done by the flags above
 	*entry |= PAGE_PRESENT;
 
-	tlb_invalidate(kernel_pml4, (void *) base);
-
 	return 0;
 }
 
-static int populate_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
+/* Maps a huge page if nothing is mapped at the PDE yet and if the range covers
+ * the entire 2M area. Huge pages are not put on the page replacement list, as
+ * they cannot be swapped out.
+ *
+ * Returns 0 if a huge page has been mapped, -1 otherwise.
+ */
+static int populate_huge_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
 	struct page_info *page;
 	struct populate_info *info = walker->udata;
 
+	if ((*entry & PAGE_PRESENT) || !hpage_covered(base, end)) {
+		return -1;
+	}
+
+	if (info->flags & PAGE_USER) {
+		page = thp_alloc(ALLOC_ZERO);
+	} else {
+		page = page_alloc(ALLOC_HUGE | ALLOC_ZERO);
+	}
+
+	if (!page) {
+		return -1;
+	}
+
+	if (info->flags & PAGE_USER) {
+		page->rmap = populate_find_vma(info, base)->rmap;
+	} else {
+		page->rmap = NULL;
+	}
+
+	page->pp_ref += 1;
+	*entry = page2pa(page) | info->flags | PAGE_PRESENT | PAGE_HUGE;
+
 	return 0;
 }
 
+/* Maps a huge page if requested and possible, or allocates a page table
+ * otherwise.
+ */
+static int populate_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct populate_info *info = walker->udata;
+
+	if (info->huge && populate_huge_pde(entry, base, end, walker) == 0) {
+		return 0;
+	}
+
+	return ptbl_alloc(entry, base, end, walker);
+}
+
 /* Populates the region [va, va + size) with pages by allocating pages from the
- * frame allocator and mapping them.
+ * frame allocator and mapping them. If flags contains PAGE_HUGE, the parts of
+ * the region that cover an entire 2M area are mapped using huge pages where
+ * possible.
  */
 void populate_region(struct page_table *pml4, void *va, size_t size,
 	uint64_t flags)
 {
 	struct populate_info info = {
-		.flags = flags,
+		.flags = flags & ~PAGE_HUGE,
 		.base = ROUNDDOWN((uintptr_t)va, PAGE_SIZE),
 		.end = ROUNDUP((uintptr_t)va + size, PAGE_SIZE) - 1,
+		.huge = !!(flags & PAGE_HUGE),
 	};
 	struct page_walker walker = {
 		.pte_callback = populate_pte,
-		.pde_callback = ptbl_alloc,
+		.pde_callback = populate_pde,
 		.pdpte_callback = ptbl_alloc,
 		.pml4e_callback = ptbl_alloc,
 		.udata = &info,
 	};
 
+	list_init(&info.pages);
+
 	if (DEBUG) cprintf("[populate_region]: [%p, %p] (R: %d, W: %d, X: %d, U: %d)\n", 
 		info.base, info.end, (flags & PAGE_PRESENT) != 0, (flags & PAGE_WRITE) != 0, (!(flags & PAGE_NO_EXEC)) != 0, (flags & PAGE_USER) != 0);
 
 
 	walk_page_range(pml4, va, (void *)((uintptr_t)va + size), &walker);
+
+	// Return the pages that have not been used
+	page_free_list(&info.pages);
+}
+
+/* Maps a huge page at the 2M aligned address va, if nothing is mapped there
+ * yet.
+ *
+ * Returns 0 on success, -1 if something is mapped already or if there is no
+ * free huge page.
+ */
+int populate_huge(struct page_table *pml4, void *va, uint64_t flags)
+{
+	struct populate_info info = {
+		.flags = flags & ~PAGE_HUGE,
+		.base = (uintptr_t)va,
+		.end = (uintptr_t)va + HPAGE_SIZE - 1,
+		.huge = 1,
+	};
+	struct page_walker walker = {
+		.pde_callback = populate_huge_pde,
+		.pdpte_callback = ptbl_alloc,
+		.pml4e_callback = ptbl_alloc,
+		.udata = &info,
+	};
+
+	assert(hpage_aligned((uintptr_t)va));
+
+	list_init(&info.pages);
+
+	return walk_page_range(pml4, va, (void *)((uintptr_t)va + HPAGE_SIZE),
+		&walker);
 }
@@ -2,6 +2,9 @@
 #include <paging.h>
 
 #include <kernel/mem.h>
+#include <kernel/dev/swap.h>
+
+extern struct swap_info swap;
 
 #define DEBUG 0
 
@@ -9,10 +12,13 @@ struct protect_info {
 	struct page_table *pml4;
 	uint64_t flags;
 	uintptr_t base, end;
+
+	/* The TLB entries to flush once the protection has been changed. */
+	struct tlb_gather tlb;
 };
 
-/* Changes the protection of the page. Avoid calling tlb_invalidate() if
- * nothing changes at all.
+/* Changes the protection of the page. Avoid gathering the TLB entry to flush
+ * if nothing changes at all.
  */
 static int protect_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
@@ -35,7 +41,8 @@ static int protect_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
 		*entry |= info->flags;
 		*entry |= PAGE_PRESENT;
 
-		tlb_invalidate(info->pml4, (void *) base);
+		tlb_gather_add(&info->tlb, base,
+			base + ((*entry & PAGE_HUGE) ? HPAGE_SIZE : PAGE_SIZE));
 	}
 
 	if (DEBUG) cprintf("[protect_region]: [%p, %p] after (R: %d, W: %d, X: %d, U: %d)\n", 
@@ -47,16 +54,27 @@ static int protect_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
 /* Changes the protection of the huge page, if the page is a huge page and if
  * the range covers the full huge page. Otherwise if the page is a huge page,
  * but if the range does not span an entire huge page, this function calls
- * ptbl_split() to split up the huge page. Avoid calling tlb_invalidate() if
- * nothing changes at all.
+ * ptbl_split() to split up the huge page. Avoid gathering the TLB entries to
+ * flush if nothing changes at all.
  */
 static int protect_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
-	struct protect_info *info = walker->udata;
+	int ret;
 
-	/* LAB 3: your code here. */
-	return 0;
+	if (!(*entry & PAGE_PRESENT) || !(*entry & PAGE_HUGE)) {
+		return 0;
+	}
+
+	if (hpage_covered(base, end)) {
+		return protect_pte(entry, base, end, walker);
+	}
+
+	spin_lock(&swap.lock);
+	ret = ptbl_split(entry, base, end, walker);
+	spin_unlock(&swap.lock);
+
+	return ret;
 }
 
 /* Changes the protection of the region [va, va + size) to the permissions
@@ -82,5 +100,7 @@ void protect_region(struct page_table *pml4, void *va, size_t size,
 		info.base, info.end, (flags & PAGE_PRESENT) != 0, (flags & PAGE_WRITE) != 0, (!(flags & PAGE_NO_EXEC)) != 0, (flags & PAGE_USER) != 0);
 
 
+	tlb_gather_init(&info.tlb, pml4);
 	walk_page_range(pml4, va, (void *)((uintptr_t)va + size), &walker);
+	tlb_gather_flush(&info.tlb);
 }
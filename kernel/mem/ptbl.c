@@ -3,6 +3,7 @@
 #include <paging.h>
 
 #include <kernel/mem.h>
+#include <kernel/dev/swap.h>
 
 #define DEBUG 0
 
@@ -52,20 +53,68 @@ int ptbl_alloc(physaddr_t *entry, uintptr_t base, uintptr_t end,
  *
  * Otherwise if a huge page is present, allocate a new page, increment the
  * reference count and have the PDE point to the newly allocated page. This
- * page is used as the page table. Then allocate a normal page for each entry,
- * copy over the data from the huge page and set each PDE.
+ * page is used as the page table, of which the entries point to the 4K pages
+ * that make up the huge page, with the same permissions.
  *
- * Hint: the only user of this function is boot_map_region(). Otherwise the 2M
- * physical page has to be split down into its individual 4K pages by updating
- * the respective struct page_info structs.
+ * For user pages, the 2M physical page is split down into its individual 4K
+ * pages by updating the respective struct page_info structs, such that they
+ * can be freed and swapped out one by one. As such, the caller must hold the
+ * swap lock.
  *
- * Hint: this function calls ptbl_alloc(), page_alloc(), page2pa() and
- * page2kva().
+ * The huge page is flushed from the TLBs of all CPUs once the PDE points to the
+ * page table, such that no CPU caches both the huge page and the 4K pages.
  */
 int ptbl_split(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
-	/* LAB 2: your code here. */
+	struct page_info *ptbl, *huge, *page;
+	struct page_table *pt;
+	physaddr_t pa;
+	uint64_t flags;
+	size_t i;
+
+	if (!(*entry & PAGE_PRESENT)) {
+		return ptbl_alloc(entry, base, end, walker);
+	}
+
+	if (!(*entry & PAGE_HUGE)) {
+		return 0;
+	}
+
+	ptbl = page_alloc(ALLOC_ZERO);
+
+	if (!ptbl) {
+		return -1;
+	}
+
+	++ptbl->pp_ref;
+	pt = page2kva(ptbl);
+
+	pa = PAGE_ADDR(*entry);
+	flags = (*entry & PAGE_MASK) & ~PAGE_HUGE;
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		pt->entries[i] = (pa + i * PAGE_SIZE) | flags;
+	}
+
+	if (flags & PAGE_USER) {
+		huge = pa2page(pa);
+
+		for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+			page = huge + i;
+			page->pp_order = 0;
+			page->pp_ref = huge->pp_ref;
+			page->rmap = huge->rmap;
+			list_init(&page->swap_node);
+			add_swap_page(page);
+		}
+	}
+
+	*entry = page2pa(ptbl) | PAGE_PRESENT | PAGE_WRITE | PAGE_USER;
+
+	base = ROUNDDOWN(base, HPAGE_SIZE);
+	tlb_flush_range(walker->pml4, base, base + HPAGE_SIZE);
+
 	return 0;
 }
 
@@ -74,20 +123,124 @@ int ptbl_split(physaddr_t *entry, uintptr_t base, uintptr_t end,
  * First checks if the PDE points to a huge page. If the PDE points to a huge
  * page there is nothing to do. Otherwise the PDE points to a page table.
  * Then this function checks all entries in the page table to check if they
- * point to present pages and share the same flags. If not all pages are
- * present or if not all flags are the same, this function simply returns.
- * At this point the pages can be merged into a huge page. This function now
- * allocates a huge page and copies over the data from the consecutive pages
- * over to the huge page.
+ * point to present user pages that are not shared and share the same flags.
+ * If not, this function simply returns.
+ * At this point the pages can be merged into a huge page. If the pages already
+ * make up an aligned 2M block, they are simply turned into a huge page.
+ * Otherwise this function allocates a huge page and copies over the data from
+ * the consecutive pages over to the huge page.
+ * The task may be running on another CPU meanwhile, so the pages are
+ * write-protected and flushed from the TLBs of all CPUs before they are merged.
+ * Writes to the pages fault and wait for the swap lock until the merge is done.
  * Finally, it sets the PDE to point to the huge page with the flags shared
- * between the previous pages.
+ * between the previous pages, flushes the 4K pages from the TLBs and adds the
+ * page table and the previously used pages to the list of pages passed through
+ * walker->udata, to be freed by the caller.
  *
- * Hint: don't forget to free the page table and the previously used pages.
+ * The caller must hold the swap lock.
  */
 int ptbl_merge(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
 {
-	/* LAB 2: your code here. */
+	struct list *freed = walker->udata;
+	struct page_info *ptbl, *first, *page, *huge;
+	struct page_table *pt;
+	uint64_t flags, bits = 0;
+	uint64_t ignore = PAGE_ACCESSED | PAGE_DIRTY;
+	size_t i;
+	int in_place;
+
+	if (!(*entry & PAGE_PRESENT) || (*entry & PAGE_HUGE) ||
+	    !hpage_covered(base, end)) {
+		return 0;
+	}
+
+	pt = KADDR(PAGE_ADDR(*entry));
+	flags = pt->entries[0] & PAGE_MASK & ~ignore;
+
+	if (!(flags & PAGE_PRESENT) || !(flags & PAGE_USER)) {
+		return 0;
+	}
+
+	first = pa2page(PAGE_ADDR(pt->entries[0]));
+	in_place = hpage_aligned(page2pa(first));
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		if ((pt->entries[i] & PAGE_MASK & ~ignore) != flags) {
+			return 0;
+		}
+
+		page = pa2page(PAGE_ADDR(pt->entries[i]));
+
+		// Pages shared with other tasks cannot be merged
+		if (page->pp_ref != 1 || page->rmap != first->rmap) {
+			return 0;
+		}
+
+		in_place = in_place && page == first + i &&
+			page->pp_nid == first->pp_nid;
+	}
+
+	if (in_place) {
+		huge = first;
+	} else {
+		huge = thp_alloc(0);
+
+		if (!huge) {
+			return 0;
+		}
+	}
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		pt->entries[i] &= ~PAGE_WRITE;
+	}
+
+	tlb_flush_range(walker->pml4, base, base + HPAGE_SIZE);
+
+	// The accessed and dirty bits are final once the TLBs are flushed
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		bits |= pt->entries[i] & ignore;
+	}
+
+	if (!in_place) {
+		for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+			page = pa2page(PAGE_ADDR(pt->entries[i]));
+			memcpy((char *)page2kva(huge) + i * PAGE_SIZE,
+				page2kva(page), PAGE_SIZE);
+		}
+
+		huge->pp_ref = 1;
+		huge->rmap = first->rmap;
+	}
+
+	// Huge pages are not on the page replacement list
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		page = pa2page(PAGE_ADDR(pt->entries[i]));
+		remove_swap_page(page);
+
+		if (page == huge) {
+			continue;
+		}
+
+		page->pp_ref = 0;
+		page->rmap = NULL;
+
+		if (!in_place) {
+			list_add_tail(freed, &page->pp_node);
+		}
+	}
+
+	huge->pp_order = BUDDY_2M_PAGE;
+
+	ptbl = pa2page(PAGE_ADDR(*entry));
+	*entry = page2pa(huge) | flags | bits | PAGE_HUGE;
+
+	// Drop the 4K pages from the TLBs before they can be freed
+	tlb_flush_range(walker->pml4, base, base + HPAGE_SIZE);
+
+	--ptbl->pp_ref;
+	list_add_tail(freed, &ptbl->pp_node);
+
 	return 0;
 }
 
@@ -121,8 +274,6 @@ int ptbl_free(physaddr_t *entry, uintptr_t base, uintptr_t end,
 	pa = PAGE_ADDR(*entry);
 	page = pa2page(pa);
 	page->pp_ref--;
-	page->pp_free = 1;
-	tlb_invalidate(pt,pt);
 	*entry = 0;
 	page_free(page);
 
@@ -2,13 +2,25 @@
 #include <paging.h>
 
 #include <kernel/mem.h>
+#include <kernel/dev/swap.h>
+
+extern struct swap_info swap;
 
 struct remove_info {
 	struct page_table *pml4;
+
+	/* Pages and page tables of which the reference count dropped to zero. */
+	struct list pages;
+
+	/* The TLB entries to flush before the pages can be freed. */
+	struct tlb_gather tlb;
 };
 
 /* Removes the page if present by decrement the reference count, clearing the
- * PTE and invalidating the TLB.
+ * PTE and gathering the TLB entry to flush. Pages that are no longer referenced
+ * are taken off the page replacement list and gathered, such that they can be
+ * freed in one go once the TLBs have been flushed. The caller must hold the
+ * swap lock.
  */
 static int remove_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
@@ -17,22 +29,28 @@ static int remove_pte(physaddr_t *entry, uintptr_t base, uintptr_t end,
 	struct page_info *page;
 	physaddr_t pa;
 
-	if (!(*entry * PAGE_PRESENT))
+	if (!(*entry & PAGE_PRESENT))
 		return 0;
 
 	pa = PAGE_ADDR(*entry);
 	page = pa2page(pa);
 
-	page_decref(page);
+	if (--page->pp_ref == 0) {
+		remove_swap_page(page);
+		list_add_tail(&info->pages, &page->pp_node);
+	}
 
 	*entry = 0;
-	tlb_invalidate(info->pml4, (void *)base);
+	tlb_gather_add(&info->tlb, base, base + PAGE_SIZE);
 
 	return 0;
 }
 
 /* Removes the page if present and if it is a huge page by decrementing the
- * reference count, clearing the PDE and invalidating the TLB.
+ * reference count, clearing the PDE and gathering the TLB entries to flush. If only part of
+ * the huge page is removed, the huge page is split up instead, such that
+ * remove_pte() can remove the 4K pages within the range. The caller must hold
+ * the swap lock.
  */
 static int remove_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
     struct page_walker *walker)
@@ -40,6 +58,55 @@ static int remove_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
 	struct remove_info *info = walker->udata;
 	struct page_info *page;
 
+	if (!(*entry & PAGE_PRESENT) || !(*entry & PAGE_HUGE))
+		return 0;
+
+	if (!hpage_covered(base, end))
+		return ptbl_split(entry, base, end, walker);
+
+	page = pa2page(PAGE_ADDR(*entry));
+
+	if (--page->pp_ref == 0) {
+		list_add_tail(&info->pages, &page->pp_node);
+	}
+
+	*entry = 0;
+	tlb_gather_add(&info->tlb, base, base + HPAGE_SIZE);
+
+	return 0;
+}
+
+/* Removes the page table if it no longer has any entries. Other CPUs may still
+ * be walking the page table, so it is gathered with the pages, such that it
+ * only gets freed once the TLBs have been flushed. Invalidating any single
+ * page also drops the cached page table entries, so gathering the first page
+ * of the range is enough.
+ */
+static int remove_ptbl(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	struct remove_info *info = walker->udata;
+	struct page_table *pt;
+	struct page_info *page;
+	size_t i;
+
+	if (!(*entry & PAGE_PRESENT))
+		return 0;
+
+	pt = KADDR(PAGE_ADDR(*entry));
+
+	for (i = 0; i < PAGE_TABLE_ENTRIES; ++i) {
+		if (pt->entries[i] & PAGE_PRESENT)
+			return 0;
+	}
+
+	page = pa2page(PAGE_ADDR(*entry));
+	--page->pp_ref;
+	list_add_tail(&info->pages, &page->pp_node);
+
+	*entry = 0;
+	tlb_gather_add(&info->tlb, base, base + PAGE_SIZE);
+
 	return 0;
 }
 
@@ -52,15 +119,23 @@ void unmap_page_range(struct page_table *pml4, void *va, size_t size)
 	struct page_walker walker = {
 		.pte_callback = remove_pte,
 		.pde_callback = remove_pde,
-		.pte_unmap = ptbl_free,
-		.pde_unmap = ptbl_free,
-		.pdpte_unmap = ptbl_free,
-		.pml4e_unmap = ptbl_free,
+		.pde_unmap = remove_ptbl,
+		.pdpte_unmap = remove_ptbl,
+		.pml4e_unmap = remove_ptbl,
 
 		.udata = &info,
 	};
 
+	list_init(&info.pages);
+	tlb_gather_init(&info.tlb, pml4);
+
+	spin_lock(&swap.lock);
 	walk_page_range(pml4, va, va + size, &walker);
+	spin_unlock(&swap.lock);
+
+	// The PTEs are gone and no CPU caches them, so the pages can be freed
+	tlb_gather_flush(&info.tlb);
+	page_free_list(&info.pages);
 }
 
 /* Unmaps all user pages. */
@@ -4,13 +4,17 @@
 #include <string.h>
 
 #include <cpu.h>
+#include <x86-64/asm.h>
 #include <kernel/mem.h>
 #include <kernel/mem/slab.h>
 #include <kernel/acpi/lapic.h>
 
 void debug_print_slab(size_t size)
 {
+	struct slab *slab;
+	struct slab_info *info;
 	size_t index;
+	void *obj;
 
 	if (size == 0) {
 		panic("[debug_print_slab]: size == 0\n");
@@ -20,161 +24,220 @@ void debug_print_slab(size_t size)
 	index = (size / SLAB_ALIGN) - 1;
 	if (index >= nslabs) {
 		return;
-		panic("[debug_print_slab]: index >= nslabs\n");
 	}
 
-
-	struct slab *slab = slabs + index;
-	struct slab_info *info;
-	struct slab_obj *obj;
+	slab = slabs + index;
 
 	if (list_is_empty(&slab->partial)) {
-		if (slab->obj_size == 128) {
-			cprintf("\n\n\t[CPU %d]: FREELIST empty\n", lapic_cpunum());
-		}
+		cprintf("\n\n\t[CPU %d]: FREELIST empty\n", lapic_cpunum());
 		return;
 	}
 
-
 	info = container_of(slab->partial.next, struct slab_info, node);
 
-	//struct slab *slab_start = info - ;
-
-	obj = container_of(info->free_list.next, struct slab_obj, node);
-
-	if (slab->obj_size == 128) {
-		assert(info->free_count);
-		cprintf("&free_count: %p\n", &info->free_count);
-		return;
-		cprintf("nfree: %d\n", info->free_count);
-		cprintf("\n\n\t[CPU %d]: FREELIST for slab size %d:\n", lapic_cpunum() ,slab->obj_size);
-		struct list *node = info->free_list.next;
-		struct slab_obj *free;
-		for (int i = 0; i < info->free_count; ++i) {
-			free = container_of(node, struct slab_obj, node);
-			cprintf("\t\t%p\n", free);
-			node = node->next; 
-		}
+	cprintf("\n\n\t[CPU %d]: FREELIST for slab size %d (%d free):\n",
+		lapic_cpunum(), slab->obj_size, info->free_count);
 
+	for (obj = info->free_list; obj; obj = slab_next_free(slab, obj)) {
+		cprintf("\t\t%p\n", obj);
 	}
-
-
 }
 
-/* A slab allocator works by maintaining a list of slabs, which consists of one
- * or more pages. These slabs are subdivided into fixed-size chunks that
- * consist of a header of the type struct slab_obj followed by sufficient
- * memory for the actual object. Following these objects, a footer for the slab
- * of type struct slab_info can be found.
+/* A slab allocator works by maintaining a list of slabs, which consist of one
+ * or more physically contiguous pages. These slabs are subdivided into fixed-size chunks that hold
+ * the actual objects, without any header. Following these objects, a footer
+ * for the slab of type struct slab_info can be found.
  *
  * This is a visual representation of such a slab:
- *   [ OBJ | DATA | OBJ | DATA | ... | INFO ]
+ *   [ DATA | DATA | ... | INFO ]
+ *
+ * The free objects of a slab form a singly linked list, of which the pointers
+ * are stored inside the free objects themselves. The slab that owns an object
+ * is found through the struct page_info of the page the object is on, as every
+ * page of the slab points to the struct slab_info.
  *
  * struct slab maintains a linked list of partial slabs, i.e. slabs that still
  * have some free objects available, and a linked of full slabs, i.e. slabs of
- * which all objects have been allocated.
+ * which all objects have been allocated. In addition, up to SLAB_EMPTY_MAX
+ * slabs of which all objects are free are kept on the list of empty slabs,
+ * such that allocating and freeing objects around a slab boundary does not
+ * go back to the buddy allocator every time. These lists are shared by all
+ * CPUs and protected by the slab lock.
+ *
+ * Objects are not cleared when they are freed. kzalloc() should be used for
+ * memory that has to start out cleared.
+ *
+ * In front of the slabs, every CPU has a magazine of free objects per slab
+ * allocator, such that most allocations and frees do not have to take the
+ * slab lock. The magazines are refilled from and flushed to the slabs in
+ * batches of KMEM_MAG_BATCH objects.
  */
 
-/* Allocates a new slab from the buddy allocator. Then this function locates
- * the struct slab_info footer at the end of the slab to initialize the list
- * of free objects and to set the number of free objects available. Then this
- * function iterates over the available objects to initialize them. More
- * specifically, it locates the header for each object and adds the object to
- * the free list of the slab, and to set a reference from the object header
- * back to the slab that owns the object. The slab is then added to the list
- * of partial slabs.
+/* Returns a pointer to the pointer to the next free object in the free
+ * object.
+ */
+static inline void **slab_free_ptr(struct slab *slab, void *obj)
+{
+	return (void **)((char *)obj + slab->free_off);
+}
+
+/* Returns the free object following the given free object. */
+void *slab_next_free(struct slab *slab, void *obj)
+{
+	return *slab_free_ptr(slab, obj);
+}
+
+/* Returns the struct slab_info of the slab that owns the object. */
+struct slab_info *slab_get_info(void *p)
+{
+	return pa2page(PADDR(p))->pp_slab;
+}
+
+/* Allocates a new slab of 2^order pages from the buddy allocator. Then this
+ * function locates the struct slab_info footer at the end of the slab to
+ * initialize the list of free objects and to set the number of free objects
+ * available, and points every page of the slab to it. Then this function iterates over the available
+ * objects to add them to the free list of the slab, in the order of their
+ * addresses. If the slab allocator has a constructor, it is called for every
+ * object. The slab is then added to the list of partial slabs.
  */
 int slab_alloc_chunk(struct slab *slab)
 {
 	struct page_info *page;
 	struct slab_info *info;
-	struct slab_obj *obj;
 	char *base;
+	void *obj;
 	size_t i;
-	void* va;
 
-	// Create new page for the slab
-	page = page_alloc(ALLOC_ZERO);
+	// Create new pages for the slab
+	page = page_alloc_order(slab->order, 0);
 	if (!page)
 		return -1;
 	assert(page->pp_ref == 0);
 
-	va = page2kva(page);
+	base = page2kva(page);
 
 	// Initialize slab info
-	info = (struct slab_info *) ((uint8_t *) va + slab->info_off);
-	//info = (struct slab_info *) va + slab->info_off;
+	info = (struct slab_info *)(base + slab->info_off);
 	info->slab = slab;
 	list_init(&info->node);
 	list_add(&slab->partial, &info->node);
-	list_init(&info->free_list);
+	info->free_list = NULL;
 	info->free_count = 0;
 
+	for (i = 0; i < (1ull << slab->order); ++i) {
+		page[i].pp_slab = info;
+	}
+
 	// Initialize objects in the page and add to free list
-	for (i = 0; i < slab->count; ++i) {
-        obj = (struct slab_obj *) ((uint8_t *) va + (i * slab->obj_size));
-        list_init(&obj->node);
-        obj->info = info;
-        list_add(&info->free_list, &obj->node);
-        info->free_count++;
-    }
+	for (i = slab->count; i > 0; --i) {
+		obj = base + (i - 1) * slab->obj_size;
+
+		if (slab->ctor)
+			slab->ctor(obj);
+
+		*slab_free_ptr(slab, obj) = info->free_list;
+		info->free_list = obj;
+		info->free_count++;
+	}
 
 	assert(info->free_count == slab->count);
 
 	return 0;
 }
 
-/* Frees a slab by removing the slab from the partial list. Then this function
- * uses page_lookup() to look up the page to free.
+/* Frees a slab by removing the slab from the list it is on. Then this function
+ * looks up the pages of the slab to free them.
  */
 void slab_free_chunk(struct slab *slab, struct slab_info *info)
 {
 	/* LAB 3: your code here. */
 	struct page_info *page;
-	struct slab *va; 
+	size_t i;
 
-	// remove slab from partial list
+	// remove slab from its list
 	list_del(&info->node);
 
-	//va = (struct slab_info *) info - slab->info_off;
-	va = (struct slab *) ((uint8_t *) info - slab->info_off);
+	page = pa2page(PADDR((char *)info - slab->info_off));
+	assert(page->pp_slab == info);
 
-	// page_lookup() should return the addr of the page to free
-	page = page_lookup(kernel_pml4, va, NULL);
-	if (!page) {
-		panic("[slab_free_chunk]: page_lookup returned NULL\n");
+	// The pages are no longer part of a slab
+	for (i = 0; i < (1ull << slab->order); ++i) {
+		list_init(&page[i].pp_node);
 	}
 
-	page_free(page);
+	page_free_order(page, slab->order);
 }
 
 /* Initializes a slab allocator for the given object size as follows:
- *  - Calculate the object size by adding the object header size and aligning
- *    it to SLAB_ALIGN bytes.
+ *  - Calculate the object size by aligning it to the alignment, which is at
+ *    least SLAB_ALIGN bytes. If the slab allocator has a constructor, the
+ *    pointer to the next free object is put after the object, such that it
+ *    does not overwrite the constructed state.
+ *  - Pick the number of pages per slab: the smallest order that wastes at most
+ *    an eighth of the slab, or otherwise the order that wastes the smallest
+ *    fraction of the slab, up to SLAB_MAX_ORDER.
  *  - Calculate the number of available objects per slab.
  *  - Fill in the actual information.
  *  - Initialize the lists of partial slabs and full slabs.
  */
-void slab_setup(struct slab *slab, size_t obj_size)
+void slab_setup(struct slab *slab, size_t obj_size, size_t align)
 {
-	size_t count;
+	size_t count, order, size, waste;
+	size_t best_order = 0, best_size = PAGE_SIZE, best_waste = PAGE_SIZE;
+
+	align = MAX(align, SLAB_ALIGN);
+
+	if (slab->ctor) {
+		slab->free_off = ROUNDUP(obj_size, sizeof(void *));
+		obj_size = slab->free_off + sizeof(void *);
+	} else {
+		slab->free_off = 0;
+	}
 
-	obj_size += sizeof(struct slab_obj);
-	obj_size = ROUNDUP(obj_size, 32);
+	obj_size = ROUNDUP(obj_size, align);
 
-	count = (PAGE_SIZE - sizeof(struct slab_info)) / obj_size;
+	for (order = 0; order <= SLAB_MAX_ORDER; ++order) {
+		size = PAGE_SIZE << order;
 
+		if (size < obj_size + sizeof(struct slab_info)) {
+			continue;
+		}
+
+		count = (size - sizeof(struct slab_info)) / obj_size;
+		waste = size - count * obj_size;
+
+		// Compare the fractions of the slab that are wasted
+		if (waste * best_size < best_waste * size) {
+			best_order = order;
+			best_size = size;
+			best_waste = waste;
+		}
+
+		if (waste * 8 <= size) {
+			break;
+		}
+	}
+
+	count = (best_size - sizeof(struct slab_info)) / obj_size;
+
+	slab->order = best_order;
 	slab->obj_size = obj_size;
 	slab->count = count;
 	slab->info_off = obj_size * count;
+	spin_init(&slab->lock, "slab_lock");
 
 	list_init(&slab->full);
 	list_init(&slab->partial);
+	list_init(&slab->empty);
+	slab->nempty = 0;
 }
 
-/* Allocates an object from the slab allocator.
+/* Allocates an object from the slab allocator. The caller must hold the slab
+ * lock.
  * This function first checks the list of partial slabs. If no partial slab is
- * available, it calls slab_alloc_chunk() to allocate a new slab.
+ * available, it takes a slab from the list of empty slabs, or calls
+ * slab_alloc_chunk() to allocate a new slab if there is none.
  * It then gets the first partial slab, and then it gets the first free object
  * from that slab.
  * To allocate the object, it removes the object from the respective free list
@@ -189,65 +252,56 @@ void slab_setup(struct slab *slab, size_t obj_size)
 void *slab_alloc(struct slab *slab)
 {
 	struct slab_info *info;
-	struct slab_obj *obj;
+	struct list *node;
+	void *obj;
 
-	if (list_is_empty(&slab->partial) && slab_alloc_chunk(slab) < 0)
-		return NULL;
+	if (list_is_empty(&slab->partial)) {
+		node = list_pop(&slab->empty);
 
-	info = container_of(slab->partial.next, struct slab_info, node);
+		if (node) {
+			--slab->nempty;
+			list_add(&slab->partial, node);
+		} else if (slab_alloc_chunk(slab) < 0) {
+			return NULL;
+		}
+	}
 
-	obj = container_of(info->free_list.next, struct slab_obj, node);
+	info = container_of(slab->partial.next, struct slab_info, node);
 
-	list_del(&obj->node);
+	obj = info->free_list;
+	info->free_list = slab_next_free(slab, obj);
 	--info->free_count;
+	info->cpu = this_cpu->cpu_id;
 
-	if (list_is_empty(&info->free_list)) {
+	if (!info->free_list) {
 		list_del(&info->node);
 		list_add(&slab->full, &info->node);
 	}
 
-	/*  Jump over the slab_obj structure and return the address of the
-	 *  first byte in this slab object.
-	 *
-	 *  Note:
-	 *
-	 *      obj + 1 == (char *) obj + sizeof(struct slab_obj)
-	 */
-
-	return obj + 1;
+	return obj;
 }
 
-/* Frees an object by adding it back to the slab allocator.
+/* Frees an object by adding it back to the slab allocator. The caller must
+ * hold the slab lock.
  *
  * First this function checks if the free list of the slab is empty. If it was,
  * then the slab is removed from the list of full slabs and added to the list
  * of partial slabs.
  * Then it frees the object by adding the object to the free list of the slab
  * and by increment the number of free objects.
- * If all objects in the slab are free, the slab allocator frees the entire
- * slab by calling slab_free_chunk().
+ * If all objects in the slab are free, the slab is moved to the list of empty
+ * slabs, unless there are SLAB_EMPTY_MAX empty slabs already, in which case
+ * the slab allocator frees the entire slab by calling slab_free_chunk().
  */
 void slab_free(void *p)
 {
-
-	/*  Get the object metadata starting from the address of the
-	 *  first byte in the actual object.
-	 *
-	 *  Note:
-	 *
-	 *    (struct slab_obj *)p - 1 == (char *) p - sizeof(struct slab_obj)
-	 */
-
-	struct slab_obj *obj = (struct slab_obj *)p - 1;
-	struct slab_info *info = obj->info;
+	struct slab_info *info = slab_get_info(p);
 	struct slab *slab = info->slab;
 
-	memset(p, 0, slab->obj_size - sizeof *obj);
-
 	/* Remove the slab page from the slab->full list as we freed one chunk
 	 * from this slab.
 	 */
-	if (list_is_empty(&info->free_list)) {
+	if (!info->free_list) {
 		list_del(&info->node);
 		list_add(&slab->partial, &info->node);
 	}
@@ -255,11 +309,135 @@ void slab_free(void *p)
 	/* Add the object back to the free list of the slab and increment
 	 * the counter of free objects.
 	 */
-	list_add(&info->free_list, &obj->node);
+	*slab_free_ptr(slab, p) = info->free_list;
+	info->free_list = p;
 	++info->free_count;
 
-	/* Free the slab if all the objects are free. */
-	if (info->free_count >= slab->count) {
+	/* Keep or free the slab if all the objects are free. */
+	if (info->free_count < slab->count) {
+		return;
+	}
+
+	if (slab->nempty < SLAB_EMPTY_MAX) {
+		list_del(&info->node);
+		list_add(&slab->empty, &info->node);
+		++slab->nempty;
+	} else {
 		slab_free_chunk(slab, info);
 	}
 }
+
+/* Returns the empty slabs of the slab allocator to the buddy allocator. As
+ * this is called to reclaim memory, the slab allocator is skipped rather than
+ * waited for if its lock is taken.
+ *
+ * Returns the number of slabs that have been freed.
+ */
+size_t slab_shrink(struct slab *slab)
+{
+	struct slab_info *info;
+	uint64_t rflags;
+	size_t nfreed = 0;
+
+	rflags = irq_save();
+
+	if (!spin_trylock(&slab->lock)) {
+		irq_restore(rflags);
+		return 0;
+	}
+
+	while (!list_is_empty(&slab->empty)) {
+		info = container_of(slab->empty.next, struct slab_info, node);
+		slab_free_chunk(slab, info);
+		++nfreed;
+	}
+
+	slab->nempty = 0;
+
+	spin_unlock(&slab->lock);
+	irq_restore(rflags);
+
+	return nfreed;
+}
+
+/* Allocates an object from the magazine of this CPU for the slab allocator.
+ * If the magazine is empty, it is first refilled with a batch of objects from
+ * the slabs while holding the slab lock.
+ *
+ * Returns the allocated object on success. Otherwise this function returns
+ * NULL.
+ */
+void *slab_cache_alloc(struct slab *slab)
+{
+	struct kmem_magazine *mag;
+	struct kmem_stats *stats;
+	uint64_t rflags;
+	void *p = NULL;
+
+	// Keep interrupt handlers on this CPU away from the magazine
+	rflags = irq_save();
+	mag = this_cpu->kmem.mags + slab->id;
+	stats = this_cpu->kmem.stats + slab->id;
+
+	if (mag->count == 0) {
+		++stats->nrefills;
+		spin_lock(&slab->lock);
+
+		while (mag->count < KMEM_MAG_BATCH) {
+			if (!(p = slab_alloc(slab)))
+				break;
+
+			mag->objs[mag->count++] = p;
+		}
+
+		spin_unlock(&slab->lock);
+	}
+
+	if (mag->count > 0) {
+		p = mag->objs[--mag->count];
+		++stats->nallocs;
+	}
+
+	irq_restore(rflags);
+
+	return p;
+}
+
+/* Frees an object by adding it to the magazine of this CPU for the slab
+ * allocator that owns the object, which may have been allocated on another
+ * CPU. If the magazine is full, a batch of objects is first returned to the
+ * slabs while holding the slab lock.
+ */
+void slab_cache_free(void *p)
+{
+	struct slab_info *info = slab_get_info(p);
+	struct slab *slab = info->slab;
+	struct kmem_magazine *mag;
+	struct kmem_stats *stats;
+	uint64_t rflags;
+
+	rflags = irq_save();
+	mag = this_cpu->kmem.mags + slab->id;
+	stats = this_cpu->kmem.stats + slab->id;
+
+	++stats->nfrees;
+
+	if (info->cpu != this_cpu->cpu_id) {
+		++stats->nremote_frees;
+	}
+
+	if (mag->count == KMEM_MAG_SIZE) {
+		++stats->nflushes;
+		spin_lock(&slab->lock);
+
+		while (mag->count > KMEM_MAG_SIZE - KMEM_MAG_BATCH) {
+			slab_free(mag->objs[--mag->count]);
+		}
+
+		spin_unlock(&slab->lock);
+	}
+
+	mag->objs[mag->count++] = p;
+
+	irq_restore(rflags);
+}
@@ -0,0 +1,192 @@
+#include <types.h>
+#include <cpu.h>
+#include <list.h>
+#include <paging.h>
+#include <vma.h>
+
+#include <x86-64/asm.h>
+
+#include <kernel/mem.h>
+#include <kernel/sched.h>
+#include <kernel/dev/oom.h>
+#include <kernel/dev/swap.h>
+#include <kernel/sched/kernel_thread.h>
+
+#define DEBUG 0
+
+extern struct swap_info swap;
+extern pid_t pid_max;
+
+/* Allocates a huge page for anonymous user memory. Such pages are mapped
+ * through an rmap, so they come from movable 2M blocks, rather than turning
+ * blocks that compaction can free up into unmovable ones.
+ */
+struct page_info *thp_alloc(int alloc_flags)
+{
+	return page_alloc(ALLOC_HUGE | ALLOC_MOVABLE | alloc_flags);
+}
+
+/* Returns whether the anonymous memory of the VMA may be backed by huge pages.
+ * Huge pages cannot be swapped out, so memory is kept in 4K pages when the
+ * system runs low on memory.
+ */
+int thp_vma_allowed(struct vma *vma)
+{
+	return !vma->vm_src && !(vma->vm_flags & VM_COLOR) &&
+	       get_total_free_memory() >= MEMORY_THRESHOLD;
+}
+
+/* Tries to handle a page fault by mapping a huge page at the 2M area around va,
+ * if that area lies within the VMA and if nothing has been mapped there yet.
+ *
+ * Returns 0 on success, -1 if the fault should be handled using 4K pages
+ * instead.
+ */
+int thp_fault(struct task *task, struct vma *vma, void *va)
+{
+	void *base = ROUNDDOWN(va, HPAGE_SIZE);
+	physaddr_t *entry;
+
+	if (!thp_vma_allowed(vma) || base < vma->vm_base ||
+	    base + HPAGE_SIZE > vma->vm_end) {
+		return -1;
+	}
+
+	entry = pde_lookup(task->task_pml4, base);
+
+	if (entry && (*entry & PAGE_PRESENT)) {
+		return -1;
+	}
+
+	if (populate_huge(task->task_pml4, base,
+	    convert_flags_from_vma_to_pages(vma->vm_flags) | PAGE_USER) < 0) {
+		return -1;
+	}
+
+	if (DEBUG) {
+		cprintf("[thp_fault]: PID %d | huge page at %p\n",
+			task->task_pid, base);
+	}
+
+	return 0;
+}
+
+/* Splits up the PDE if it points to a huge page. */
+static int split_huge_pde(physaddr_t *entry, uintptr_t base, uintptr_t end,
+    struct page_walker *walker)
+{
+	if ((*entry & PAGE_PRESENT) && (*entry & PAGE_HUGE)) {
+		return ptbl_split(entry, base, end, walker);
+	}
+
+	return 0;
+}
+
+/* Splits up the huge pages in the range [va, va + size) into 4K pages. */
+void split_huge_pages(struct page_table *pml4, void *va, size_t size)
+{
+	struct page_walker walker = {
+		.pde_callback = split_huge_pde,
+	};
+
+	spin_lock(&swap.lock);
+	walk_page_range(pml4, va, (void *)((uintptr_t)va + size), &walker);
+	spin_unlock(&swap.lock);
+}
+
+/* Splits up the huge pages of every user task, such that their pages can be
+ * swapped out. Called when the system runs low on memory.
+ */
+void thp_split_tasks(void)
+{
+	struct task *task;
+	pid_t pid;
+
+	for (pid = 1; pid < pid_max; ++pid) {
+		task = pid2task(pid, 0);
+
+		if (!task || task->task_type != TASK_TYPE_USER ||
+		    task->task_status == TASK_DYING) {
+			continue;
+		}
+
+		split_huge_pages(task->task_pml4, 0, USER_LIM);
+	}
+}
+
+/* Merges the fully populated page tables of the task into huge pages. Only the
+ * 2M areas that lie entirely within a VMA are considered. The pages that were
+ * merged are freed once they have been flushed from the TLBs of all CPUs.
+ */
+static void thp_collapse_task(struct task *task)
+{
+	struct vma *vma;
+	struct list *node, freed;
+	struct page_walker walker = {
+		.pde_callback = ptbl_merge,
+		.udata = &freed,
+	};
+	void *base, *end;
+
+	list_init(&freed);
+
+	list_foreach(&task->task_mmap, node) {
+		vma = container_of(node, struct vma, vm_mmap);
+
+		if (vma->vm_flags & VM_COLOR) {
+			continue;
+		}
+
+		base = ROUNDUP(vma->vm_base, HPAGE_SIZE);
+		end = ROUNDDOWN(vma->vm_end, HPAGE_SIZE);
+
+		if (base < end) {
+			walk_page_range(task->task_pml4, base, end, &walker);
+		}
+	}
+
+	page_free_list(&freed);
+}
+
+static void yield_thp(void)
+{
+	cur_task->task_frame.rip = (uint64_t) &thp_thread;
+	cur_task->task_frame.rsp = KERNEL_STACK_TOP;
+	sched_yield();
+}
+
+/* Kernel thread that collapses the 4K pages of user tasks into huge pages in
+ * the background, as long as the system is not low on memory. The tasks may be
+ * running on other CPUs meanwhile, see ptbl_merge().
+ */
+void thp_thread(void)
+{
+	struct task *task;
+	uint64_t rflags;
+	pid_t pid;
+
+	for (pid = 1; pid < pid_max; ++pid) {
+		if (get_total_free_memory() < MEMORY_THRESHOLD) {
+			break;
+		}
+
+		task = pid2task(pid, 0);
+
+		if (!task || task->task_type != TASK_TYPE_USER ||
+		    task->task_status == TASK_DYING) {
+			continue;
+		}
+
+		// Don't get preempted while holding the swap lock
+		rflags = irq_save();
+
+		if (spin_trylock(&swap.lock)) {
+			thp_collapse_task(task);
+			spin_unlock(&swap.lock);
+		}
+
+		irq_restore(rflags);
+	}
+
+	yield_thp();
+}
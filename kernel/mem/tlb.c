@@ -1,22 +1,417 @@
 #include <types.h>
+#include <atomic.h>
+#include <cpu.h>
 #include <paging.h>
+#include <spinlock.h>
+
+#include <x86-64/asm.h>
 
 #include <kernel/mem.h>
 
-/* Invalidate a TLB entry, but only if the page tables being modified are the
- * ones currently in use by the processor.
+#define DEBUG 0
+
+/* The CPUID leaves and bits that report support for PCIDs and INVPCID. */
+#define CPUID_FEATURES        1
+#define CPUID_FEATURES_PCID   (1 << 17)
+#define CPUID_EXT_FEATURES    7
+#define CPUID_EXT_INVPCID     (1 << 10)
+
+/* The PCID in the lower bits of CR3, and the bit that tells the CPU to keep
+ * the TLB entries tagged with the PCID upon loading CR3.
+ */
+#define CR3_PCID_MASK         0xfff
+#define CR3_NO_FLUSH          (1ull << 63)
+
+/* The INVPCID type that invalidates a single address for a single PCID. */
+#define INVPCID_ADDR          0
+
+/* The shootdown request that is being served by the other CPUs. Only one
+ * request is in flight at a time.
+ */
+static struct {
+	/* The PML4 to flush, or zero to flush on every CPU. */
+	physaddr_t pml4;
+
+	/* The range [start, end) to flush. */
+	uintptr_t start, end;
+
+	/* The CPUs that have yet to flush, indexed by their position in cpus. */
+	volatile uint64_t pending;
+} shootdown;
+
+#ifndef USE_BIG_KERNEL_LOCK
+/* Lock for the shootdown request. */
+struct spinlock tlb_lock = {
+#ifdef DEBUG_SPINLOCK
+	.name = "tlb_lock",
+#endif
+};
+#endif
+
+static void lock_tlb(void)
+{
+#ifndef USE_BIG_KERNEL_LOCK
+	spin_lock(&tlb_lock);
+#endif
+}
+
+static void unlock_tlb(void)
+{
+#ifndef USE_BIG_KERNEL_LOCK
+	spin_unlock(&tlb_lock);
+#endif
+}
+
+/* Whether TLB entries are tagged with PCIDs, such that they survive context
+ * switches.
+ */
+int pcid_enabled;
+static int has_invpcid;
+
+/* The number of pages up to which a range is flushed one page at a time. */
+size_t tlb_flush_max_pages = TLB_FLUSH_MAX_PAGES;
+
+/* Enables global pages on the boot CPU, such that the kernel mappings survive
+ * CR3 reloads, and enables PCIDs if the CPU supports them. Must be called with
+ * PCID zero loaded in CR3.
+ */
+void tlb_init(void)
+{
+	uint32_t max_leaf, ebx = 0, ecx;
+
+	write_cr4(read_cr4() | CR4_PGE);
+
+	cpuid(0, &max_leaf, NULL, NULL, NULL);
+	cpuid(CPUID_FEATURES, NULL, NULL, &ecx, NULL);
+
+	if (!(ecx & CPUID_FEATURES_PCID)) {
+		return;
+	}
+
+	if (max_leaf >= CPUID_EXT_FEATURES) {
+		cpuid_count(CPUID_EXT_FEATURES, 0, NULL, &ebx, NULL, NULL);
+	}
+
+	has_invpcid = !!(ebx & CPUID_EXT_INVPCID);
+	pcid_enabled = 1;
+
+	write_cr4(read_cr4() | CR4_PCIDE);
+
+	if (DEBUG) {
+		cprintf("[tlb_init]: PCIDs enabled, INVPCID %s\n",
+			has_invpcid ? "supported" : "not supported");
+	}
+}
+
+/* Enables global pages on the other CPUs, as well as PCIDs if they have been
+ * enabled on the boot CPU.
+ */
+void tlb_init_mp(void)
+{
+	write_cr4(read_cr4() | CR4_PGE);
+
+	if (pcid_enabled) {
+		write_cr4(read_cr4() | CR4_PCIDE);
+	}
+}
+
+/* Flushes every TLB entry on this CPU, including the global ones, by toggling
+ * CR4.PGE.
+ */
+static void tlb_flush_global(void)
+{
+	uint64_t cr4 = read_cr4();
+
+	write_cr4(cr4 & ~CR4_PGE);
+	write_cr4(cr4);
+}
+
+/* Flushes the TLB entries of [start, end) of the address space that is loaded
+ * on this CPU, one page at a time or all at once for larger ranges. As
+ * reloading CR3 keeps the global entries, larger ranges that cover the kernel
+ * part flush the global entries as well.
+ */
+static void tlb_flush_local(uintptr_t start, uintptr_t end)
+{
+	struct tlb_state *tlb = &this_cpu->tlb;
+	uintptr_t va;
+
+	if ((end - start) / PAGE_SIZE > tlb_flush_max_pages) {
+		if (end > USER_LIM) {
+			tlb_flush_global();
+		} else {
+			write_cr3(read_cr3());
+		}
+
+		++tlb->nflush_full;
+		return;
+	}
+
+	for (va = start; va < end; va += PAGE_SIZE) {
+		flush_page((void *)va);
+	}
+
+	tlb->nflush_pages += (end - start) / PAGE_SIZE;
+}
+
+/* Marks the TLB entries of the address space with the given PML4 as stale on
+ * every CPU, or of every address space if pml4 is zero, except for the address
+ * space that is loaded on this CPU, of which the caller takes care. On this
+ * CPU, small ranges are invalidated right away using INVPCID if possible.
+ * Must be called with interrupts disabled.
+ */
+static void tlb_mark_stale(physaddr_t pml4, uintptr_t start, uintptr_t end)
+{
+	struct cpuinfo *cpu;
+	struct tlb_pcid *slot;
+	uint64_t pcid, cur_pcid = read_cr3() & CR3_PCID_MASK;
+	uintptr_t va;
+	size_t i;
+	int invalidate = has_invpcid &&
+		(end - start) / PAGE_SIZE <= tlb_flush_max_pages;
+
+	for (cpu = cpus; cpu < cpus + ncpus; ++cpu) {
+		for (i = 0; i < TLB_NR_PCIDS; ++i) {
+			slot = cpu->tlb.pcids + i;
+			pcid = i + 1;
+
+			if (!slot->pml4 || (pml4 && slot->pml4 != pml4)) {
+				continue;
+			}
+
+			if (cpu != this_cpu) {
+				slot->stale = 1;
+			} else if (pcid == cur_pcid) {
+				continue;
+			} else if (invalidate) {
+				for (va = start; va < end; va += PAGE_SIZE)
+					invpcid(INVPCID_ADDR, pcid, (void *)va);
+			} else {
+				slot->stale = 1;
+			}
+		}
+	}
+}
+
+/* Flushes the TLB on behalf of the CPU that sent the pending shootdown
+ * request, if any, and lets it know that we are done.
+ */
+void tlb_shootdown_handler(void)
+{
+	struct cpuinfo *cpu = this_cpu;
+	uint64_t bit = 1ull << (cpu - cpus);
+
+	if (!(shootdown.pending & bit)) {
+		return;
+	}
+
+	if (!shootdown.pml4 || cpu->tlb.pml4 == shootdown.pml4) {
+		tlb_flush_local(shootdown.start, shootdown.end);
+	}
+
+	atomic_sub(&shootdown.pending, bit);
+}
+
+/* Serves pending shootdown requests while spinning with interrupts disabled,
+ * as the CPU that sent the request waits for us.
+ */
+void tlb_shootdown_poll(void)
+{
+	if (shootdown.pending) {
+		tlb_shootdown_handler();
+	}
+}
+
+/* Sends a shootdown IPI for [start, end) to every other CPU that has the
+ * address space with the given PML4 loaded, or to every other CPU that has
+ * started if pml4 is zero, as the kernel mappings are cached even by the CPUs
+ * that are idle or have yet to run a task. Waits until they all flushed their
+ * TLB. Must be called with interrupts disabled.
+ */
+static void tlb_shootdown(physaddr_t pml4, uintptr_t start, uintptr_t end)
+{
+	struct cpuinfo *cpu, *self = this_cpu;
+	uint64_t mask = 0;
+
+	lock_tlb();
+
+	for (cpu = cpus; cpu < cpus + ncpus; ++cpu) {
+		if (cpu == self || cpu->cpu_status != CPU_STARTED) {
+			continue;
+		}
+
+		if (!pml4 || cpu->tlb.pml4 == pml4) {
+			mask |= 1ull << (cpu - cpus);
+		}
+	}
+
+	if (mask) {
+		++self->tlb.nshootdowns;
+		shootdown.pml4 = pml4;
+		shootdown.start = start;
+		shootdown.end = end;
+		shootdown.pending = mask;
+		atomic_barrier();
+
+		for (cpu = cpus; cpu < cpus + ncpus; ++cpu) {
+			if (mask & (1ull << (cpu - cpus))) {
+				lapic_ipi_cpu(cpu->cpu_id, IRQ_TLB);
+			}
+		}
+
+		while (shootdown.pending)
+			;
+	}
+
+	unlock_tlb();
+}
+
+/* Switches to the address space with the given PML4. Each CPU tags the TLB
+ * entries of the address spaces it ran last with their own PCID, such that
+ * they don't have to be flushed when switching back, unless the page tables
+ * changed in the meantime. The least recently used PCID is reused.
+ */
+void tlb_load_pml4(struct page_table *pml4)
+{
+	struct tlb_state *tlb;
+	struct tlb_pcid *slot, *victim = NULL;
+	physaddr_t pa = PADDR(pml4);
+	uint64_t rflags, flush;
+	size_t i;
+
+	rflags = irq_save();
+	tlb = &this_cpu->tlb;
+
+	// Let other CPUs know before checking whether our entries are stale
+	tlb->pml4 = pa;
+	atomic_barrier();
+
+	if (!pcid_enabled) {
+		load_pml4((struct page_table *)pa);
+		irq_restore(rflags);
+		return;
+	}
+
+	for (i = 0; i < TLB_NR_PCIDS; ++i) {
+		slot = tlb->pcids + i;
+
+		if (slot->pml4 == pa) {
+			break;
+		}
+
+		if (!victim || slot->last_used < victim->last_used) {
+			victim = slot;
+		}
+	}
+
+	if (i < TLB_NR_PCIDS) {
+		flush = xchg(&slot->stale, 0);
+	} else {
+		// Take over the PCID and drop the entries of its previous owner
+		slot = victim;
+		slot->stale = 0;
+		slot->pml4 = pa;
+		flush = 1;
+	}
+
+	slot->last_used = ++tlb->clock;
+
+	// Nothing to do if we switch back to the address space that is loaded
+	if (flush || read_cr3() != (pa | (slot - tlb->pcids + 1))) {
+		write_cr3(pa | (slot - tlb->pcids + 1) | (flush ? 0 : CR3_NO_FLUSH));
+	}
+
+	irq_restore(rflags);
+}
+
+/* Flushes the TLB entries of [start, end) of the address space with the given
+ * PML4 on every CPU, or of every address space if pml4 is NULL. The entries
+ * are flushed right away on the CPUs that have the address space loaded, and
+ * upon the next load on the CPUs that only have it tagged with a PCID. As the
+ * kernel part is shared by all address spaces, changes to it affect every
+ * address space, and flush its global entries on every CPU.
+ */
+void tlb_flush_range(struct page_table *pml4, uintptr_t start, uintptr_t end)
+{
+	physaddr_t pa = 0;
+	uint64_t rflags;
+
+	if (start >= end) {
+		return;
+	}
+
+	if (pml4 && end <= USER_LIM) {
+		pa = PADDR(pml4);
+	}
+
+	rflags = irq_save();
+
+	if (!pa || PAGE_ADDR(read_cr3()) == pa) {
+		tlb_flush_local(start, end);
+	}
+
+	if (pcid_enabled) {
+		tlb_mark_stale(pa, start, end);
+	}
+
+	// Make the stale marks visible before looking at the loaded PML4s
+	atomic_barrier();
+	tlb_shootdown(pa, start, end);
+
+	irq_restore(rflags);
+}
+
+/* Invalidate a TLB entry on every CPU that may have it cached.
  *
  * Hint: this function calls flush_page().
  */
 void tlb_invalidate(struct page_table *pml4, void *va)
 {
-	/* Flush the entry only if we are modifying the current address space.
-	 *
-	 * Note: for now, there is only one address space, so always invalidate.
-	 */
-	/* LAB 2: your code here. */
-	if(read_cr3() == PADDR(pml4)){
-        flush_page(va);
-    }
+	tlb_flush_range(pml4, (uintptr_t)va, (uintptr_t)va + PAGE_SIZE);
+}
+
+/* Flushes all TLB entries of the address space with the given PML4. */
+void tlb_flush(struct page_table *pml4)
+{
+	tlb_flush_range(pml4, 0, USER_LIM);
+}
+
+/* Flushes the user TLB entries of every address space. The global kernel
+ * entries are kept.
+ */
+void tlb_flush_user(void)
+{
+	tlb_flush_range(NULL, 0, USER_LIM);
+}
+
+/* Flushes every TLB entry of every address space, including the global kernel
+ * entries. Used for the rare changes to the kernel mappings.
+ */
+void tlb_flush_all(void)
+{
+	tlb_flush_range(NULL, 0, ~0ull);
 }
 
+/* Starts gathering the TLB entries to flush for the address space. */
+void tlb_gather_init(struct tlb_gather *tlb, struct page_table *pml4)
+{
+	tlb->pml4 = pml4;
+	tlb->start = ~0ull;
+	tlb->end = 0;
+}
+
+/* Adds the range [start, end) to the TLB entries to flush. */
+void tlb_gather_add(struct tlb_gather *tlb, uintptr_t start, uintptr_t end)
+{
+	tlb->start = MIN(tlb->start, start);
+	tlb->end = MAX(tlb->end, end);
+}
+
+/* Flushes the gathered TLB entries on every CPU, such that the pages that
+ * were unmapped can be freed, and starts over.
+ */
+void tlb_gather_flush(struct tlb_gather *tlb)
+{
+	tlb_flush_range(tlb->pml4, tlb->start, tlb->end);
+	tlb_gather_init(tlb, tlb->pml4);
+}
@@ -247,6 +247,8 @@ static int pml4_walk_range(struct page_table *pml4, uintptr_t base, uintptr_t en
 	int ret;
 	uintptr_t idx, addr, next;
 
+	walker->pml4 = pml4;
+
 	next = base;
 	for (addr = sign_extend(base); next < end; addr = next) {
 		next = sign_extend(pml4_end(addr) + 1);
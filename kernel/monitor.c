@@ -10,6 +10,7 @@
 #include <x86-64/asm.h>
 
 #include <cpu.h>
+#include <lib.h>
 
 #include <kernel/acpi.h>
 #include <kernel/console.h>
@@ -32,9 +33,12 @@ static struct command commands[] = {
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "backtrace", "Display stack backtrace", mon_backtrace },
 	{ "buddyinfo", "Display debugging information for the buddy allocator", mon_buddyinfo },
+	{ "meminfo", "Display free memory statistics", mon_meminfo },
 	{ "pageinfo", "Display page information for a given page index", mon_pageinfo },
 	{ "ptdump", "Display the page tables", mon_ptdump },
 	{ "vmainfo", "Display the VMAs", mon_vmainfo },
+	{ "slabinfo", "Display statistics of the slab allocators", mon_slabinfo },
+	{ "tlbinfo", "Display TLB flush statistics or set the flush threshold", mon_tlbinfo },
 };
 
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
@@ -99,6 +103,32 @@ int mon_buddyinfo(int argc, char **argv, struct int_frame *frame)
 	return 0;
 }
 
+int mon_meminfo(int argc, char **argv, struct int_frame *frame)
+{
+	struct buddy_stats stats;
+	size_t order, nid;
+
+	buddy_get_stats(&stats);
+
+	cprintf("Free chunks per order:\n");
+
+	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
+		cprintf("  order #%u: %u\n", order, stats.nfree[order]);
+	}
+
+	cprintf("Free pages:   %u\n", stats.nfree_pages);
+
+	for (nid = 0; stats.nnodes > 1 && nid < stats.nnodes; ++nid) {
+		cprintf("  node #%u: %u\n", nid, stats.node_nfree_pages[nid]);
+	}
+
+	cprintf("Cached pages: %u\n", stats.ncached_pages);
+	cprintf("Free memory:  %u kiB\n",
+		(stats.nfree_pages + stats.ncached_pages) * PAGE_SIZE / 1024);
+
+	return 0;
+}
+
 int mon_pageinfo(int argc, char **argv, struct int_frame *frame)
 {
 	struct page_info *page;
@@ -185,6 +215,50 @@ int mon_vmainfo(int argc, char **argv, struct int_frame *frame)
 	return 0;
 }
 
+int mon_slabinfo(int argc, char **argv, struct int_frame *frame)
+{
+	struct slabinfo info;
+	size_t id;
+
+	cprintf("%-16s %5s %7s %7s %3s %5s %5s %5s %5s %8s %8s %7s %7s %7s\n",
+		"name", "size", "active", "total", "pgs", "slabs", "part",
+		"full", "empty", "allocs", "frees", "refills", "flushes",
+		"remote");
+
+	for (id = 0; kmem_get_info(id, &info) == 0; ++id) {
+		cprintf("%-16s %5u %7u %7u %3u %5u %5u %5u %5u %8u %8u %7u "
+			"%7u %7u\n",
+			info.name, info.obj_size, info.active_objs,
+			info.total_objs, info.pages_per_slab, info.nslabs,
+			info.npartial, info.nfull, info.nempty, info.nallocs,
+			info.nfrees, info.nrefills, info.nflushes,
+			info.nremote_frees);
+	}
+
+	return 0;
+}
+
+int mon_tlbinfo(int argc, char **argv, struct int_frame *frame)
+{
+	struct cpuinfo *cpu;
+
+	if (argc >= 2) {
+		tlb_flush_max_pages = strtol(argv[1], NULL, 0);
+	}
+
+	cprintf("Ranges of up to %u pages are flushed page by page\n",
+		tlb_flush_max_pages);
+	cprintf("%3s %12s %12s %12s\n", "cpu", "pages", "full", "shootdowns");
+
+	for (cpu = cpus; cpu < cpus + ncpus; ++cpu) {
+		cprintf("%3u %12u %12u %12u\n", cpu->cpu_id,
+			cpu->tlb.nflush_pages, cpu->tlb.nflush_full,
+			cpu->tlb.nshootdowns);
+	}
+
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -48,8 +48,11 @@ void boot_cpus(void)
 		/* Start the CPU at boot_ap16(). */
 		lapic_startup(cpu->cpu_id, PADDR(code));
 
-		/* Wait until the CPU becomes ready. */
-		while (cpu->cpu_status != CPU_STARTED);
+		/* Wait until the CPU becomes ready, serving the TLB shootdowns it
+		 * may send in the meantime.
+		 */
+		while (cpu->cpu_status != CPU_STARTED)
+			tlb_shootdown_poll();
 	}
 }
 
@@ -62,6 +65,9 @@ void mp_main(void)
 	/* Load the kernel PML4. */
 	asm volatile("movq %0, %%cr3\n" :: "r" (PADDR(kernel_pml4)));
 
+	/* Tag the TLB entries with PCIDs if the boot CPU does. */
+	tlb_init_mp();
+
 	/* Load the per-CPU kernel stack. */
 	asm volatile("movq %0, %%rsp\n" :: "r" (mpentry_kstack));
 
@@ -79,6 +85,9 @@ void mp_main(void)
 	cprintf("IDT INIT MP done\n");
 	syscall_init_mp(); //TO DO optional
 	cprintf("SYSCALL OPT done\n");
+	/* Set up the per-CPU page cache. */
+	page_cache_init();
+
 	/* Set up the per-CPU slab allocator. */
 	kmem_init_mp();
 	cprintf("KMEM INIT MP done\n");
@@ -103,6 +112,11 @@ void mp_main(void)
 	spin_lock(&kernel_lock);
 #endif
 
+	/* Help to free the memory that was not initialized at boot. This has to
+	 * wait for the big kernel lock, as the buddy allocator relies on it.
+	 */
+	page_init_deferred();
+
 	sched_yield();
 }
 
@@ -51,9 +51,12 @@ int copy_page_range(struct task *parent_task, struct task *child_task, void *sta
 {
 	void *va;
 	struct page_info *page;
-	physaddr_t *entry = kmalloc(sizeof(physaddr_t *));
+	physaddr_t *entry = NULL;
 	uint64_t page_flags;
 
+	// Huge pages are not shared copy-on-write, split them up first
+	split_huge_pages(parent_task->task_pml4, start_va, end_va - start_va);
+
 	for (va = start_va; va < end_va; va += PAGE_SIZE) {
 		page = page_lookup(parent_task->task_pml4, va, &entry);
 		if(!page || !entry){
@@ -103,20 +106,24 @@ struct task *task_clone(struct task *task)
 		return NULL;
 
 	// Copy VMAs
-	list_init(&child_task->task_mmap);
-
 	list_foreach(&task->task_mmap, node) {
 		parent_vma = container_of(node, struct vma, vm_mmap);
-		child_vma = kmalloc(sizeof(struct vma));
+		child_vma = kmem_cache_alloc(vma_cache);
 		
 		if(!child_vma){
 			cprintf("[task_clone]: Error: kmalloc failed\n");
 			return NULL;
 		}
 		
-		memcpy(child_vma, parent_vma, sizeof(struct vma));
-		list_init(&child_vma->vm_mmap);
-		rb_node_init(&child_vma->vm_rb);
+		// Copy the VMA, the nodes have been initialized by the cache
+		child_vma->vm_name = parent_vma->vm_name;
+		child_vma->vm_base = parent_vma->vm_base;
+		child_vma->vm_end = parent_vma->vm_end;
+		child_vma->vm_src = parent_vma->vm_src;
+		child_vma->vm_len = parent_vma->vm_len;
+		child_vma->vm_flags = parent_vma->vm_flags;
+		child_vma->rmap = parent_vma->rmap;
+		child_vma->task = child_task;
 
 		// Add reverse mapping node
 		rmap = child_vma->rmap;
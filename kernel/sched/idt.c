@@ -16,6 +16,7 @@
 #include <kernel/vma/pfault.h>
 #include <kernel/vma/show.h>
 #include <kernel/mem/dump.h>
+#include <kernel/mem/tlb.h>
 
 #define DEBUG 0
 #define DEBUG_INT_FRAME 0
@@ -46,6 +47,7 @@ extern void isr18(int int_no);
 extern void isr19(int int_no);
 extern void isr30(int int_no);
 extern void isr32(int int_no);
+extern void isr52(int int_no);
 extern void isr128(int int_no);
 
 static const char *int_names[256] = {
@@ -70,6 +72,7 @@ static const char *int_names[256] = {
 	[INT_SECURITY] = "Security (#SX)",
 	[INT_SYSCALL] = "Syscall",
 	[IRQ_TIMER] = "IRQ Timer",
+	[IRQ_TLB] = "IRQ TLB Shootdown",
 };
 
 static struct idt_entry entries[256];
@@ -182,6 +185,7 @@ void idt_init(void)
 	set_idt_entry(&entries[INT_SIMD], &isr19, flags, GDT_KCODE);
 	set_idt_entry(&entries[INT_SECURITY], &isr30, flags, GDT_KCODE);
 	set_idt_entry(&entries[IRQ_TIMER], &isr32, flags, GDT_KCODE);
+	set_idt_entry(&entries[IRQ_TLB], &isr52, flags, GDT_KCODE);
 	set_idt_entry(&entries[INT_SYSCALL], &isr128, flags_brk_and_sys, GDT_KCODE);
 
 	load_idt(&idtr);
@@ -245,6 +249,16 @@ void int_handler(struct int_frame *frame)
 
 	if (DEBUG) cprintf("Incoming INT frame at %p\n", frame);
 
+	/* Flush the TLB on behalf of another CPU and return straight to
+	 * whatever got interrupted, which may be a kernel thread. This must not
+	 * take the big kernel lock, as the other CPU may be holding it.
+	 */
+	if (frame->int_no == IRQ_TLB) {
+		lapic_eoi();
+		tlb_shootdown_handler();
+		task_pop_frame(frame);
+	}
+
 	if ((frame->cs & 3) == 3) {
 		/* Interrupt from user mode. */
 		assert(cur_task);
@@ -24,47 +24,8 @@ extern struct spinlock runq_lock;
 extern size_t nuser_tasks;
 extern size_t nkernel_tasks;
 extern struct list runq;
-extern struct list zero_list;
 extern pid_t pid_max;
 
-void zero_page(struct page_info *page)
-{
-	uint64_t paddr = page2pa(page);
-
-	memset((void *) paddr, 0, PAGE_SIZE);
-}
-
-/* When a page is freed, set the first byte of the page to 1. When we free a page
- * set this byte and all other bytes to 0
- *
- * TODO: set first byte to 1 in page free
- *  
- */
-void zero_all_pages(void)
-{
-	struct list *free_node;
-	struct page_info *free_page;
-
-	lock_buddy();
-
-	cprintf("\n\n\tzero\n\n");
-
-	free_node = list_pop(&zero_list);
-	while (free_node) {
-		free_page = container_of(free_node, struct page_info, pp_zero_node);
-		zero_page(free_page);
-		free_page->pp_zero = 1;
-		free_node = list_pop(&zero_list);
-	}
-
-	unlock_buddy();
-
-	cur_task->task_frame.rip = (uint64_t) &zero_all_pages;
-	cur_task->task_frame.rsp = KERNEL_STACK_TOP;
-
-	sched_yield();
-}
-
 void create_kernel_thread(uint64_t func_ptr)
 {
 	pid_t pid;
@@ -99,7 +60,7 @@ void create_kernel_thread(uint64_t func_ptr)
 
 	// We are out of PIDs 
 	if (pid == 1) {
-		kfree(task);
+		task_cache_free(task);
         panic("Error: no PIDs remaining to create kernel thread\n");
 	}
 
@@ -177,7 +177,10 @@ void sched_yield(void)
 
 	if (nuser_tasks == nkernel_tasks) {
 		cprintf("\n\tNo tasks remaining!\n\n");
-		while(1);
+
+		// Other CPUs may still be waiting for us to flush our TLB
+		while(1)
+			tlb_shootdown_poll();
 	}
 
 	debug_print("(CPU %d) Moving current task to nextq\n", this_cpu->cpu_id);
@@ -209,6 +212,9 @@ void sched_yield(void)
 	print_cpu_tasks(debug);
 
 	if (try_run_next_task() < 0) {
+		// Nothing to run, so prepare zeroed pages in the meantime
+		page_zero_idle();
+
 		// Release the lock to allow another task to run
 		release_and_acquire_lock();
 		sched_yield();
@@ -223,6 +229,9 @@ void sched_halt()
 	spin_unlock(&kernel_lock);
 #endif
 
+	// This CPU no longer runs any task, so it won't need any shootdowns
+	this_cpu->tlb.pml4 = 0;
+
 	while (1) {
 		monitor(NULL);
 	}
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <assert.h>
 #include <cpu.h>
+#include <lib.h>
 
 #include <x86-64/asm.h>
 #include <x86-64/gdt.h>
@@ -80,6 +81,25 @@ static int sys_getcpuid(void)
 	return this_cpu->cpu_id;
 }
 
+/* Copies the statistics of the slab allocator with the given id to the user.
+ * Returns -1 if there is no such slab allocator, such that the user can
+ * iterate over the slab allocators until this fails.
+ */
+static int sys_slabinfo(struct slabinfo *info, size_t id)
+{
+	struct slabinfo kinfo;
+
+	assert_user_mem(cur_task, info, sizeof *info, PAGE_USER | PAGE_WRITE);
+
+	if (kmem_get_info(id, &kinfo) < 0) {
+		return -1;
+	}
+
+	memcpy(info, &kinfo, sizeof *info);
+
+	return 0;
+}
+
 /* Dispatches to the correct kernel function, passing the arguments. */
 int64_t syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3,
         uint64_t a4, uint64_t a5, uint64_t a6)
@@ -121,6 +141,8 @@ int64_t syscall(uint64_t syscallno, uint64_t a1, uint64_t a2, uint64_t a3,
 		return sys_waitpid((pid_t) a1, (int *) a2, (int) a3);
 	case SYS_getcpuid:
 		return sys_getcpuid();
+	case SYS_slabinfo:
+		return sys_slabinfo((struct slabinfo *)a1, (size_t)a2);
 	case NSYSCALLS:
 		cprintf("[syscall]: Syscall `NSYSCALLS` not implemented\n");
 		return -ENOSYS;
@@ -22,7 +22,6 @@
 
 extern struct list buddy_free_list[BUDDY_MAX_ORDER];
 extern struct list runq;
-extern struct list zero_list;
 extern struct spinlock runq_lock;
 extern struct spinlock console_lock;
 
@@ -31,6 +30,37 @@ struct task **tasks = (struct task **)PIDMAP_BASE;
 size_t nuser_tasks = 0;
 size_t nkernel_tasks = 0;
 
+/* The cache to allocate struct task from. */
+static struct slab *task_cache;
+
+/* Sets up the lists, the red-black tree and the lock of a task. Tasks must be
+ * returned to the cache in this state.
+ */
+static void task_ctor(void *p)
+{
+	struct task *task = p;
+
+	list_init(&task->task_mmap);
+	rb_init(&task->task_rb);
+	list_init(&task->task_node);
+	list_init(&task->task_child);
+	list_init(&task->task_children);
+	list_init(&task->task_zombies);
+
+#ifndef USE_BIG_KERNEL_LOCK
+	spin_init(&task->task_lock, "task_lock");
+#endif
+}
+
+/* Returns the task struct to the task cache, restoring its constructed state
+ * first.
+ */
+void task_cache_free(struct task *task)
+{
+	task_ctor(task);
+	kmem_cache_free(task_cache, task);
+}
+
 /* Looks up the respective task for a given PID.
  * If check_perm is non-zero, this function checks if the PID maps to the
  * current task or if the current task is the parent of the task that the PID
@@ -83,13 +113,23 @@ void task_init(void)
 
 	extern struct page_table *kernel_pml4;
 	size_t tasks_array_size = pid_max * sizeof(struct task *);
-	uint64_t flags = (PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC);
+	uint64_t flags = (PAGE_PRESENT | PAGE_WRITE | PAGE_NO_EXEC | PAGE_GLOBAL);
 
 	populate_region(kernel_pml4, tasks, tasks_array_size, flags);
 
 	for (size_t pid = 0; pid < pid_max; ++pid) {
 		tasks[pid] = NULL;
 	}
+
+	/* Set up the caches for tasks and VMAs. */
+	task_cache = kmem_cache_create("task", sizeof(struct task),
+		CACHE_LINE_SIZE, task_ctor);
+
+	if (!task_cache) {
+		panic("unable to create the task cache!");
+	}
+
+	vma_init();
 }
 
 /* Sets up the virtual address space for the task. */
@@ -131,7 +171,7 @@ struct task *task_alloc(pid_t ppid)
 	pid_t pid;
 
 	/* Allocate a new task struct. */
-	task = kmalloc(sizeof *task);
+	task = kmem_cache_alloc(task_cache);
 
 	if (!task) {
 		return NULL;
@@ -139,7 +179,7 @@ struct task *task_alloc(pid_t ppid)
 
 	/* Set up the virtual address space for the task. */
 	if (task_setup_vas(task) < 0) {
-		kfree(task);
+		kmem_cache_free(task_cache, task);
 		return NULL;
 	}
 
@@ -156,7 +196,7 @@ struct task *task_alloc(pid_t ppid)
 
 	/* We are out of PIDs. */
 	if (pid == pid_max) {
-		kfree(task);
+		kmem_cache_free(task_cache, task);
 		//unlock here
 		return NULL;
 	}
@@ -165,9 +205,12 @@ struct task *task_alloc(pid_t ppid)
 
 	/* Set up the task. */
 	task->task_ppid = ppid;
-	//task->task_type = TASK_TYPE_USER;
+	task->task_type = TASK_TYPE_USER;
 	task->task_status = TASK_RUNNABLE;
 	task->task_runs = 0;
+	task->task_wait = NULL;
+	task->task_cpunum = 0;
+	task->jiffies = 0;
 
 	memset(&task->task_frame, 0, sizeof task->task_frame);
 
@@ -179,14 +222,9 @@ struct task *task_alloc(pid_t ppid)
 
 	/* You will set task->task_frame.rip later. */
 
-	/* LAB 4 TODO: initialize task->task_rb and task->task_mmap */
-	list_init(&task->task_mmap);
-	rb_init(&task->task_rb);
-	list_init(&task->task_node);
-	list_init(&task->task_child);
-	list_init(&task->task_children);
-	list_init(&task->task_zombies);
-
+	/* The lists, task->task_rb and the lock have been set up by task_ctor()
+	 * already.
+	 */
 
 	cprintf("[PID %5u] New task with PID %u\n",
 	        cur_task ? cur_task->task_pid : 0, task->task_pid);
@@ -296,7 +334,7 @@ static void task_load_elf(struct task *task, uint8_t *binary)
 
 	// Temporarily switch to this tasks pml4 so that we can initialize the memory for the ELF segments
 	physaddr_t old_cr3 = read_cr3();
-	load_pml4((struct page_table *) PADDR(task->task_pml4));
+	tlb_load_pml4(task->task_pml4);
 
 	// Load ELF segments
 	load_elf_segments(elf, task, binary);
@@ -307,7 +345,7 @@ static void task_load_elf(struct task *task, uint8_t *binary)
 	add_anonymous_vma(task, "stack", (void *) USTACK_TOP - PAGE_SIZE, PAGE_SIZE, vma_flags);
 
 	// Return to the old pml4
-	load_pml4((struct page_table *) old_cr3);
+	tlb_load_pml4(KADDR(PAGE_ADDR(old_cr3)));
 }
 
 /* Allocates a new task with task_alloc(), loads the named ELF binary using
@@ -343,7 +381,7 @@ void task_free(struct task *task)
 	 * before freeing the page tables, just in case the page gets re-used.
 	 */
 	if (task == cur_task) {
-		load_pml4((struct page_table *)PADDR(kernel_pml4));
+		tlb_load_pml4(kernel_pml4);
 	}
 
 	/* Unmap the task from the PID map. */
@@ -362,9 +400,12 @@ void task_free(struct task *task)
 	cprintf("[PID %5u] Freed task with PID %u\n", cur_task ? cur_task->task_pid : 0,
 	    task->task_pid);
 
-	/* Free the task. */
+	/* Free the task. It may still be linked into the lists of its parent
+	 * and children, or hold its lock, so return it to its constructed
+	 * state first.
+	 */
 	free_vmas(task);	
-	kfree(task);
+	task_cache_free(task);
 }
 
 /*
@@ -494,7 +535,7 @@ void task_run(struct task *task)
 	 *     2. Set 'cur_task' to the new task,
 	 *     3. Set its status to TASK_RUNNING,
 	 *     4. Update its 'task_runs' counter,
-	 *     5. Use load_pml4() to switch to its address space.
+	 *     5. Use tlb_load_pml4() to switch to its address space.
 	 * Step 2: Use task_pop_frame() to restore the task's
 	 *     registers and drop into user mode in the
 	 *     task.
@@ -521,7 +562,7 @@ void task_run(struct task *task)
 	cur_task->task_status = TASK_RUNNING;
 	cur_task->task_runs++;
 
-	load_pml4((struct page_table *) PADDR(task->task_pml4));
+	tlb_load_pml4(task->task_pml4);
 
 	debug_print("(CPU %d) Running task PID %d!\n", this_cpu->cpu_id, task->task_pid);
 
@@ -73,7 +73,9 @@ void __spin_lock(struct spinlock *lock, const char *file, int line)
 	}
 #endif
 
-	while (!atomic_cmpxchg(&lock->locked, 0, 1));
+	// Keep serving TLB shootdowns, as the holder may be waiting for them
+	while (!atomic_cmpxchg(&lock->locked, 0, 1))
+		tlb_shootdown_poll();
 
 	if (cur_task)
 		debug_print("(CPU: %d | PID: %3d)$ Lock acquired!\n", this_cpu->cpu_id, cur_task->task_pid);
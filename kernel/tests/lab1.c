@@ -5,8 +5,6 @@
 
 #include <kernel/mem.h>
 
-extern struct list buddy_free_list[];
-
 /* Checks the number of free pages available in both base memory and high
  * memory.
  */
@@ -14,13 +12,14 @@ void lab1_check_free_list_avail(void)
 {
 	struct page_info *page;
 	struct list *node;
-	size_t order;
+	size_t mt, order;
 	size_t nfree_basemem = 0;
 	size_t nfree_extmem = 0;
 
 
+	for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt)
 	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		list_foreach(buddy_free_list + order, node) {
+		list_foreach(buddy_zones[0].free_list[mt] + order, node) {
 			page = container_of(node, struct page_info, pp_node);
 
 			if (page2pa(page) < EXT_PHYS_MEM) {
@@ -44,11 +43,12 @@ void lab1_check_free_list_order(void)
 {
 	struct page_info *page;
 	struct list *node;
-	size_t order;
+	size_t mt, order;
 	size_t nviolations = 0;
 
+	for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt)
 	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		list_foreach(buddy_free_list + order, node) {
+		list_foreach(buddy_zones[0].free_list[mt] + order, node) {
 			page = container_of(node, struct page_info, pp_node);
 
 			if (page->pp_order != order)
@@ -150,9 +150,9 @@ void lab1_check_buddy_consistency(void)
 
 void lab1_check_split_and_merge(int flags)
 {
-	struct list stolen_free_list[10];
+	struct buddy_zone stolen_zone;
 	struct page_info *page;
-	size_t order;
+	size_t mt, order;
 	size_t nfree_pages;
 
 	/* Count the number of order 9 pages. */
@@ -165,7 +165,7 @@ void lab1_check_split_and_merge(int flags)
 		page = page_alloc(ALLOC_HUGE);
 	else
 #endif
-		page = buddy_find(BUDDY_2M_PAGE);
+		page = buddy_find(BUDDY_2M_PAGE, MIGRATE_UNMOVABLE);
 
 	if (!page) {
 		panic("can't allocate 2M page!");
@@ -174,12 +174,19 @@ void lab1_check_split_and_merge(int flags)
 	/* Check against the count of huge pages. */
 	assert(count_free_pages(BUDDY_2M_PAGE) + 1 == nfree_pages);
 
-	/* Steal the lists of free pages. */
+	/* Steal the lists of free pages along with their counters. */
+	stolen_zone = buddy_zones[0];
+
 	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		stolen_free_list[order] = buddy_free_list[order];
-		list_init(buddy_free_list + order);
+		for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt) {
+			list_init(buddy_zones[0].free_list[mt] + order);
+		}
+
+		buddy_zones[0].nfree[order] = 0;
 	}
 
+	buddy_zones[0].nfree_pages = 0;
+
 	/* Return the huge page. */
 	page_free(page);
 
@@ -218,16 +225,14 @@ void lab1_check_split_and_merge(int flags)
 	if (flags & ALLOC_HUGE)
 		page = page_alloc(ALLOC_HUGE);
 	else
-		page = buddy_find(BUDDY_2M_PAGE);
+		page = buddy_find(BUDDY_2M_PAGE, MIGRATE_UNMOVABLE);
 
 	if (!page) {
 		panic("can't allocate 2M page!");
 	}
 
 	/* Return the lists of free chunks. */
-	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		buddy_free_list[order] = stolen_free_list[order];
-	}
+	buddy_zones[0] = stolen_zone;
 
 	/* Return the huge page. */
 	page_free(page);
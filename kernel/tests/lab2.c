@@ -6,7 +6,6 @@
 
 #include <kernel/mem.h>
 
-extern struct list buddy_free_list[];
 extern struct page_table *kernel_pml4;
 
 int lab2_do_check_ptbl_flags(physaddr_t *entry, uintptr_t base, uintptr_t end,
@@ -453,11 +452,12 @@ void lab2_check_free_list_order(void)
 {
 	struct page_info *page;
 	struct list *node;
-	size_t order;
+	size_t mt, order;
 	size_t nviolations = 0;
 
+	for (mt = 0; mt < NR_MIGRATE_TYPES; ++mt)
 	for (order = 0; order < BUDDY_MAX_ORDER; ++order) {
-		list_foreach(buddy_free_list + order, node) {
+		list_foreach(buddy_zones[0].free_list[mt] + order, node) {
 			page = container_of(node, struct page_info, pp_node);
 
 			if (page->pp_order != order)
@@ -575,6 +575,26 @@ void lab2_check_paging(void)
         **/
 }
 
+/* Checks that allocating and freeing a transparent huge page leaves its 2M
+ * block movable, such that compaction can still free it up.
+ */
+void lab2_check_thp_mobility(void)
+{
+	struct page_info *page;
+
+	page = thp_alloc(ALLOC_ZERO);
+
+	if (!page) {
+		panic("cannot allocate transparent huge page!");
+	}
+
+	assert(page->pp_blocktype == MIGRATE_MOVABLE);
+	page_free(page);
+	assert(page->pp_blocktype == MIGRATE_MOVABLE);
+
+	cprintf("[LAB 2] check_thp_mobility() succeeded!\n");
+}
+
 void lab2_check_buddy(struct boot_info *boot_info)
 {
 	lab2_check_free_list_order();
@@ -584,6 +604,7 @@ void lab2_check_buddy(struct boot_info *boot_info)
         lab2_check_buddy_full_consistency();
 #endif
 	lab2_check_vas();
+	lab2_check_thp_mobility();
 
 #ifdef EXTENDED_CHECKS_LAB2
         lab2_check_vas_ext();
@@ -10,12 +10,12 @@
 void lab3_check_kmem_init(void)
 {
 	struct slab *slab;
-	size_t obj_size;
+	size_t obj_size, slab_size;
 	size_t i;
 
 	for (i = 0; i < 32; ++i) {
 		slab = slabs + i;
-		obj_size = ROUNDUP((i + 1) * 32 + sizeof(struct slab_obj), 32);
+		obj_size = (i + 1) * 32;
 
 		if (!list_is_empty(&slab->partial)) {
 			panic("slab for object size %u has partial slabs",
@@ -31,6 +31,19 @@ void lab3_check_kmem_init(void)
 			panic("slab for object size %u has unexpected object "
 				"size of %u\n", obj_size, slab->obj_size);
 		}
+
+		slab_size = PAGE_SIZE << slab->order;
+
+		if (slab->info_off + sizeof(struct slab_info) > slab_size) {
+			panic("slab for object size %u does not fit in %u "
+				"pages", obj_size, 1 << slab->order);
+		}
+
+		if (slab->order < SLAB_MAX_ORDER &&
+		    (slab_size - slab->info_off) * 8 > slab_size) {
+			panic("slab for object size %u wastes more than an "
+				"eighth of %u pages", obj_size, 1 << slab->order);
+		}
 	}
 
 	cprintf("[LAB 3] check_kmem_init() succeeded!\n");
@@ -40,7 +53,6 @@ void lab3_check_kmem_single_alloc(void)
 {
 	struct slab *slab;
 	struct slab_info *info;
-	struct slab_obj *obj;
 	void *p;
 	size_t obj_size, real_obj_size;
 	size_t i;
@@ -48,7 +60,7 @@ void lab3_check_kmem_single_alloc(void)
 	for (i = 0; i < 32; ++i) {
 		slab = slabs + i;
 		obj_size = (i + 1) * 32;
-		real_obj_size = ROUNDUP(obj_size + sizeof(struct slab_obj), 32);
+		real_obj_size = obj_size;
 
 		if (!list_is_empty(&slab->partial)) {
 			panic("slab for object size %u has partial slabs",
@@ -65,10 +77,11 @@ void lab3_check_kmem_single_alloc(void)
 				"size of %u\n", obj_size, slab->obj_size);
 		}
 
-		p = kmalloc(obj_size);
+		p = slab_alloc(slab);
 
 		if (!p) {
-			panic("kmalloc(%u) returned NULL", obj_size);
+			panic("slab_alloc() returned NULL for object size %u",
+				obj_size);
 		}
 
 		if (list_is_empty(&slab->partial)) {
@@ -88,14 +101,12 @@ void lab3_check_kmem_single_alloc(void)
 				"counts");
 		}
 
-		obj = (struct slab_obj *)p - 1;
-
-		if (obj->info != info) {
+		if (slab_get_info(p) != info) {
 			panic("allocated object does not point to the slab it "
 				"has been allocated from");
 		}
 
-		kfree(p);
+		slab_free(p);
 
 		if (!list_is_empty(&slab->partial)) {
 			panic("slab for object size %u has partial slabs",
@@ -106,6 +117,16 @@ void lab3_check_kmem_single_alloc(void)
 			panic("slab for object size %u has full slabs",
 				obj_size);
 		}
+
+		if (slab->nempty != 1 || list_is_empty(&slab->empty)) {
+			panic("slab for object size %u did not keep the empty "
+				"slab", obj_size);
+		}
+
+		if (slab_shrink(slab) != 1 || !list_is_empty(&slab->empty)) {
+			panic("slab for object size %u did not free the empty "
+				"slab", obj_size);
+		}
 	}
 
 	cprintf("[LAB 3] check_kmem_single_alloc() succeeded!\n");
@@ -115,7 +136,6 @@ void lab3_check_kmem_full_alloc(void)
 {
 	struct slab *slab;
 	struct slab_info *info;
-	struct slab_obj *obj;
 	void *p = NULL;
 	size_t obj_size, real_obj_size;
 	size_t i, k;
@@ -123,7 +143,7 @@ void lab3_check_kmem_full_alloc(void)
 	for (i = 0; i < 32; ++i) {
 		slab = slabs + i;
 		obj_size = (i + 1) * 32;
-		real_obj_size = ROUNDUP(obj_size + sizeof(struct slab_obj), 32);
+		real_obj_size = obj_size;
 
 		if (!list_is_empty(&slab->partial)) {
 			panic("slab for object size %u has partial slabs",
@@ -141,10 +161,11 @@ void lab3_check_kmem_full_alloc(void)
 		}
 
 		for (k = 0; k < slab->count; ++k) {
-			p = kmalloc(obj_size);
+			p = slab_alloc(slab);
 
 			if (!p) {
-				panic("kmalloc(%u) returned NULL", obj_size);
+				panic("slab_alloc() returned NULL for object size %u",
+				obj_size);
 			}
 		}
 
@@ -165,14 +186,12 @@ void lab3_check_kmem_full_alloc(void)
 				"objects", obj_size);
 		}
 
-		obj = (struct slab_obj *)p - 1;
-
-		if (obj->info != info) {
+		if (slab_get_info(p) != info) {
 			panic("allocated object does not point to the slab it "
 				"has been allocated from");
 		}
 
-		kfree(p);
+		slab_free(p);
 
 		if (list_is_empty(&slab->partial)) {
 			panic("slab for object size %u has no partial slabs",
@@ -192,11 +211,31 @@ void lab3_check_kmem_full_alloc(void)
 
 void lab3_check_kmem_limit(void)
 {
+	struct page_info *page;
 	void *p;
-	size_t size = (nslabs + 1) * 32 + 1;
+	size_t size = PAGE_SIZE + 1;
 
 	p = kmalloc(size);
 
+	if (!p) {
+		panic("kmalloc(%u) returned NULL", size);
+	}
+
+	page = pa2page(PADDR(p));
+
+	if (!page->pp_kmalloc || page->pp_order != 1) {
+		panic("kmalloc(%u) did not allocate two pages", size);
+	}
+
+	kfree(p);
+
+	if (page->pp_kmalloc) {
+		panic("kfree() did not free the pages of kmalloc(%u)", size);
+	}
+
+	size = (PAGE_SIZE << (BUDDY_MAX_ORDER - 1)) + 1;
+	p = kmalloc(size);
+
 	if (p) {
 		panic("kmalloc(%u) should not allocate memory", size);
 	}
@@ -204,12 +243,50 @@ void lab3_check_kmem_limit(void)
 	cprintf("[LAB 3] check_kmem_limit() succeeded!\n");
 }
 
+void lab3_check_kmem_magazine(void)
+{
+	struct kmem_magazine *mag;
+	void *p, *q;
+	size_t count;
+
+	p = kmalloc(SLAB_ALIGN);
+
+	if (!p) {
+		panic("kmalloc(%u) returned NULL", SLAB_ALIGN);
+	}
+
+	mag = this_cpu->kmem.mags + slab_get_info(p)->slab->id;
+	count = mag->count;
+
+	// A full magazine first returns a batch of objects to the slabs
+	if (count == KMEM_MAG_SIZE) {
+		count -= KMEM_MAG_BATCH;
+	}
+
+	kfree(p);
+
+	if (mag->count != count + 1 || mag->objs[count] != p) {
+		panic("kfree() did not put the object in the magazine");
+	}
+
+	q = kmalloc(SLAB_ALIGN);
+
+	if (q != p) {
+		panic("kmalloc() did not reuse the object in the magazine");
+	}
+
+	kfree(q);
+
+	cprintf("[LAB 3] check_kmem_magazine() succeeded!\n");
+}
+
 void lab3_check_kmem(void)
 {
 	lab3_check_kmem_init();
 	lab3_check_kmem_single_alloc();
 	lab3_check_kmem_full_alloc();
 	lab3_check_kmem_limit();
+	lab3_check_kmem_magazine();
 }
 
 int lab3_check_pte_us(physaddr_t *entry, uintptr_t base, uintptr_t end,
@@ -5,6 +5,42 @@
 #include <kernel/dev/rmap.h>
 #include <lib.h>
 
+/* The caches to allocate struct vma and struct rmap from. */
+struct slab *vma_cache;
+struct slab *rmap_cache;
+
+/* Sets up the list nodes and the red-black tree node of a VMA. */
+static void vma_ctor(void *p)
+{
+	struct vma *vma = p;
+
+	list_init(&vma->vm_mmap);
+	rb_node_init(&vma->vm_rb);
+	list_init(&vma->rmap_node);
+}
+
+/* Sets up the list of VMAs and the lock of an rmap. */
+static void rmap_ctor(void *p)
+{
+	struct rmap *rmap = p;
+
+	list_init(&rmap->vmas);
+	spin_init(&rmap->lock, "rmap");
+}
+
+/* Creates the caches for VMAs and rmaps. */
+void vma_init(void)
+{
+	vma_cache = kmem_cache_create("vma", sizeof(struct vma),
+		CACHE_LINE_SIZE, vma_ctor);
+	rmap_cache = kmem_cache_create("rmap", sizeof(struct rmap), 0,
+		rmap_ctor);
+
+	if (!vma_cache || !rmap_cache) {
+		panic("unable to create the VMA caches!");
+	}
+}
+
 /* Inserts the given VMA into the red-black tree of the given task. First tries
  * to find a VMA for the end address of the given end address. If there is
  * already a VMA that overlaps, this function returns -1. Then the VMA is
@@ -117,35 +153,38 @@ struct vma *create_vma(struct task *task, char *name, void *addr, size_t size,
 
 	assert(task);
 
-	// Create new vma structure
-	vma = kmalloc(sizeof (*vma));
+	// Create new vma structure, the list and rb tree nodes have been
+	// initialized by vma_ctor()
+	vma = kmem_cache_alloc(vma_cache);
 	if(!vma) {
 		cprintf("Error: kmalloc failed\n");
 		return NULL;
 	}
 
-	// Initialize vma linked list node and rb tree node
-	list_init(&vma->vm_mmap);
-	rb_node_init(&vma->vm_rb);
-
-
 	// Set vma values - this determines its place in the rb tree
 	vma->vm_name = name;
 	vma->vm_base = ROUNDDOWN(addr, PAGE_SIZE);
 	vma->vm_end = ROUNDUP(addr + size, PAGE_SIZE);
 	vma->vm_flags = flags;
+	vma->vm_src = NULL;
+	vma->vm_len = 0;
 	vma->task = task;
 
 	// Setup reverse mapping
-	rmap = kmalloc(sizeof (struct rmap));
-	list_init(&rmap->vmas);
-	spin_init(&rmap->lock, "rmap");
+	rmap = kmem_cache_alloc(rmap_cache);
+	if (!rmap) {
+		kmem_cache_free(vma_cache, vma);
+		return NULL;
+	}
+
 	vma->rmap = rmap;
 	list_add(&rmap->vmas, &vma->rmap_node);
 
 	if(insert_vma(task, vma) < 0) {
 		cprintf("Error: insert_vma failed\n");
-		kfree(vma);
+		list_del(&vma->rmap_node);
+		kmem_cache_free(rmap_cache, rmap);
+		kmem_cache_free(vma_cache, vma);
 		return NULL;
 	}
 
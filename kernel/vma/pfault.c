@@ -23,7 +23,13 @@ int copy_on_write(struct task *task, void *va, struct page_info *page, physaddr_
 		return 0;
 	}
 
-	new_page = page_alloc(ALLOC_ZERO);
+	if (vma->vm_flags & VM_COLOR) {
+		new_page = page_alloc_color(PAGE_INDEX((uintptr_t)va),
+			ALLOC_ZERO | ALLOC_MOVABLE);
+	} else {
+		new_page = page_alloc(ALLOC_ZERO | ALLOC_MOVABLE);
+	}
+
 	if (!new_page) {
 		cprintf("[copy_on_write]: page_alloc failed\n");
 		return -1;
@@ -42,26 +48,39 @@ int task_page_fault_handler(struct task *task, void *va, int flags)
 	/* LAB 4: your code here. */
 	struct vma *vma;
 	struct page_info *page, *new_page;
-	physaddr_t *entry = kmalloc(sizeof(physaddr_t *));
+	physaddr_t *entry = NULL;
 	int ret;
 
 	vma = task_find_vma(task, va);
 	if (!vma)
 		return -1;
 
+	// Look up the page under the swap lock, such that it is not being
+	// swapped out or migrated by compaction meanwhile
+	spin_lock(&swap.lock);
 	page = page_lookup(task->task_pml4, ROUNDDOWN(va, PAGE_SIZE), &entry);
 
-	if (page) {
-		spin_lock(&swap.lock);
+	// Huge pages are not on the page replacement list
+	if (page && !(*entry & PAGE_HUGE)) {
 		// Add page to swap list if it's not already in it
 		add_swap_page(page);
 		// Move page to front of swap list - set as most recently used
 		mru_swap_page(page);
-		spin_unlock(&swap.lock);
+	}
+
+	spin_unlock(&swap.lock);
+
+	// The PTE already allows the access if it was write-protected while
+	// compaction migrated the page, and has been restored since
+	if (page && (!(flags & VM_WRITE) || (*entry & PAGE_WRITE)) &&
+	    (!(flags & VM_EXEC) || !(*entry & PAGE_NO_EXEC))) {
+		return 0;
 	}
 
 	if(page && *entry && (vma->vm_flags & VM_WRITE) && !(*entry & PAGE_WRITE)){
 		ret = copy_on_write(task, va, page, entry, vma);
+	} else if (!page && thp_fault(task, vma, va) == 0) {
+		ret = 0;
 	} else {
 		ret = populate_vma_range(task, ROUNDDOWN(va, PAGE_SIZE), PAGE_SIZE, flags);
 	}
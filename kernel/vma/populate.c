@@ -92,6 +92,11 @@ int do_populate_vma(struct task *task, void *base, size_t size,
 	} 
 	else {
 		page_flags = convert_flags_from_vma_to_pages(vma->vm_flags) | PAGE_USER;
+
+		// Map the 2M areas in the range using huge pages if possible
+		if (thp_vma_allowed(vma))
+			page_flags |= PAGE_HUGE;
+
 		populate_region(task->task_pml4, p_base, p_size, page_flags);
 	}
 
@@ -17,7 +17,7 @@ int do_protect_vma(struct task *task, void *base, size_t size, struct vma *vma,
 	uint64_t page_flags;
 	
 	// If protection flags are equal do nothing
-	if(vma->vm_flags == *(int *)udata){
+	if((vma->vm_flags & ~VM_COLOR) == *(int *)udata){
 		return 0;
 	}
 
@@ -28,7 +28,7 @@ int do_protect_vma(struct task *task, void *base, size_t size, struct vma *vma,
 	}
 
 	// Update protection flags of the split VMA
-	s_vma->vm_flags = *(int *)udata;
+	s_vma->vm_flags = *(int *)udata | (s_vma->vm_flags & VM_COLOR);
 
 	// Change protection of physical pages
 	// --> Added after assignment feedback - NOT TESTED
@@ -130,7 +130,8 @@ void *sys_mmap(void *addr, size_t len, int prot, int flags, int fd,
 		return MAP_FAILED;
 	
 	// Only allow these flags
-	if((flags & ~(MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_POPULATE)) != 0) {
+	if((flags & ~(MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED | MAP_POPULATE |
+	    MAP_COLORED)) != 0) {
 		return MAP_FAILED;
 	}
 
@@ -149,6 +150,10 @@ void *sys_mmap(void *addr, size_t len, int prot, int flags, int fd,
 	if (!vma)
 		return MAP_FAILED;
 
+	// MAP_COLORED: spread the pages of the VMA across the page colors
+	if (flags & MAP_COLORED)
+		vma->vm_flags |= VM_COLOR;
+
 	// MAP_POPULATE: populate the new VMA
 	if(flags & MAP_POPULATE) {
 		ret = populate_vma_range(cur_task, vma->vm_base, vma->vm_end - vma->vm_base, flags);
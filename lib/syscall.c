@@ -104,3 +104,8 @@ unsigned int getcpuid(void)
 	return syscall(SYS_getcpuid, 0, 0, 0, 0, 0, 0, 0);
 }
 
+int slabinfo(struct slabinfo *info, size_t id)
+{
+	return syscall(SYS_slabinfo, 0, (uint64_t)info, id, 0, 0, 0, 0);
+}
+
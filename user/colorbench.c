@@ -0,0 +1,80 @@
+/* Compares the time it takes to repeatedly walk buffers of different sizes
+ * with a page-sized stride, with and without page coloring. Without page
+ * coloring, the pages of a buffer can pile up in the same cache sets and evict
+ * each other, even if the buffer fits in the cache.
+ */
+#include <lib.h>
+
+#define NROUNDS   64
+#define LINE_SIZE 64
+#define MIN_SIZE  (64 * 1024)
+#define MAX_SIZE  (1024 * 1024)
+
+static inline uint64_t rdtsc(void)
+{
+	uint32_t lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/* Walks the buffer one page at a time, touching every cache line in the page
+ * before moving on to the next page, and returns the number of cycles per
+ * access.
+ */
+static uint64_t walk(volatile char *buf, size_t size)
+{
+	uint64_t start, end;
+	size_t round, line, off;
+
+	// Warm up the cache
+	for (off = 0; off < size; off += LINE_SIZE)
+		buf[off];
+
+	start = rdtsc();
+
+	for (round = 0; round < NROUNDS; ++round) {
+		for (line = 0; line < PAGE_SIZE; line += LINE_SIZE) {
+			for (off = line; off < size; off += PAGE_SIZE)
+				buf[off];
+		}
+	}
+
+	end = rdtsc();
+
+	return (end - start) / (NROUNDS * (size / LINE_SIZE));
+}
+
+static uint64_t bench(size_t size, int flags)
+{
+	char *buf;
+	uint64_t cycles;
+
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE | flags, -1, 0);
+
+	if (buf == MAP_FAILED) {
+		printf("mmap failed\n");
+		exit();
+	}
+
+	cycles = walk(buf, size);
+	munmap(buf, size);
+
+	return cycles;
+}
+
+int main(int argc, char **argv)
+{
+	size_t size;
+
+	printf("%8s %12s %12s\n", "size", "plain", "colored");
+
+	for (size = MIN_SIZE; size <= MAX_SIZE; size *= 2) {
+		printf("%7uK %12u %12u\n", size / 1024,
+			bench(size, 0), bench(size, MAP_COLORED));
+	}
+
+	return 0;
+}
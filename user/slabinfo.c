@@ -0,0 +1,25 @@
+/* Prints the statistics of every slab allocator in the kernel. */
+#include <lib.h>
+
+int main(int argc, char **argv)
+{
+	struct slabinfo info;
+	size_t id;
+
+	printf("%-16s %5s %7s %7s %3s %5s %5s %5s %5s %8s %8s %7s %7s %7s\n",
+		"name", "size", "active", "total", "pgs", "slabs", "part",
+		"full", "empty", "allocs", "frees", "refills", "flushes",
+		"remote");
+
+	for (id = 0; slabinfo(&info, id) == 0; ++id) {
+		printf("%-16s %5u %7u %7u %3u %5u %5u %5u %5u %8u %8u %7u "
+			"%7u %7u\n",
+			info.name, info.obj_size, info.active_objs,
+			info.total_objs, info.pages_per_slab, info.nslabs,
+			info.npartial, info.nfull, info.nempty, info.nallocs,
+			info.nfrees, info.nrefills, info.nflushes,
+			info.nremote_frees);
+	}
+
+	return 0;
+}